@@ -0,0 +1,178 @@
+/*
+ * accesslog.c - the access log (-L)
+ *
+ * Every request ends in one line of fixed fields:
+ *
+ *   time status outcome bytes header cache_find connect first_byte total method url
+ *
+ * time is the Unix time in ms when the request finished, status is what
+ * the client got (0 if nothing), outcome is what the cache did (LOG_*),
+ * bytes is what was written to the client, and the phases (PH_*) are in
+ * us, "-" for ones the request never reached.
+ *
+ * Request threads never write the file or take a lock for it.  Each one
+ * has a ring of LOG_RING records that only it fills, taken over from an
+ * exited thread or made the first time it logs (tslot_claim(), stats.c).  A writer thread drains every ring each LOG_FLUSH_MS,
+ * formats the records into one large buffer and writes that out.  A
+ * thread whose ring is full drops the record and counts it rather than
+ * wait for the writer: a slow disk costs log lines, not latency.
+ */
+#include "proxy.h"
+
+#define LOG_BATCH (256 * 1024)  /* formatted bytes per write() */
+#define LOG_LINE  (LOG_URL + 256)  /* longest formatted record */
+
+typedef struct {
+  access_rec r;
+  long long when;  // ms since the epoch
+} log_entry;
+
+/* Single producer (the owning thread), single consumer (log_writer()) */
+typedef struct {
+  tslot slot;             // first, see tslot_claim()
+  log_entry ent[LOG_RING];
+  unsigned head;          // next slot to fill; only the owner moves it
+  unsigned tail;          // next slot to drain; only the writer moves it
+  unsigned long drops;    // only the owner writes it
+} log_ring;
+
+static tslot_list rings = TSLOT_LIST(log_ring);
+static __thread log_ring *self;
+static int log_fd = -1;
+
+static const char *outcome_names[] = {
+  "NONE", "HIT", "STALE", "MISS", "REVALIDATED", "COLLAPSED", "NEGATIVE"
+};
+
+static void *log_writer(void *vargp);
+
+void log_init() {
+  pthread_t tid;
+
+  if (config.access_log == NULL)
+    return;
+  if ((log_fd = open(config.access_log, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+    unix_error("log_init: open error");
+  Pthread_create(&tid, NULL, log_writer, NULL);
+}
+
+/* This thread's ring, taken over or made on first use */
+static log_ring *log_self() {
+  if (self == NULL)
+    self = (log_ring *)tslot_claim(&rings);
+  return self;
+}
+
+/* A request line has come in */
+void log_start(access_rec *r) {
+  int i;
+
+  r->start = now_us();
+  for (i = 0; i < PH_NPHASES; i++)
+    r->us[i] = -1;
+  r->bytes = 0;
+  r->status = 0;
+  r->outcome = LOG_NONE;
+  r->method[0] = r->url[0] = '\0';
+}
+
+void log_url(access_rec *r, const char *method, const char *url) {
+  if (log_fd < 0)
+    return;
+  snprintf(r->method, sizeof(r->method), "%s", method);
+  snprintf(r->url, sizeof(r->url), "%s", url);
+}
+
+/* r is finished, one way or another: queue its record for the writer */
+void log_request(access_rec *r) {
+  struct timespec ts;
+  log_ring *g;
+  log_entry *e;
+  unsigned head;
+
+  if (r->start == 0)
+    return;  // logged already
+  r->us[PH_TOTAL] = now_us() - r->start;
+  r->start = 0;
+  if (log_fd < 0)
+    return;
+
+  g = log_self();
+  head = g->head;
+  if (head - __atomic_load_n(&g->tail, __ATOMIC_ACQUIRE) >= LOG_RING) {
+    __atomic_store_n(&g->drops, g->drops + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  e = &g->ent[head % LOG_RING];
+  e->r = *r;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  e->when = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+  __atomic_store_n(&g->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Records dropped on full rings so far */
+unsigned long log_drops() {
+  unsigned long n = 0;
+  log_ring *g;
+
+  for (g = (log_ring *)__atomic_load_n(&rings.head, __ATOMIC_ACQUIRE); g; g = (log_ring *)g->slot.next)
+    n += __atomic_load_n(&g->drops, __ATOMIC_RELAXED);
+  return n;
+}
+
+/* One record as a line in out, which has LOG_LINE bytes; returns its length */
+static size_t log_format(char *out, log_entry *e) {
+  access_rec *r = &e->r;
+  size_t n;
+  int i;
+
+  n = sprintf(out, "%lld.%03lld %d %s %zu", e->when / 1000, e->when % 1000, r->status,
+              outcome_names[r->outcome], r->bytes);
+  for (i = 0; i < PH_NPHASES; i++)
+    n += r->us[i] < 0 ? sprintf(out + n, " -") : sprintf(out + n, " %lld", r->us[i]);
+  n += sprintf(out + n, " %s %s\n", r->method[0] ? r->method : "-", r->url[0] ? r->url : "-");
+  return n;
+}
+
+static void log_write(char *buf, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(log_fd, buf, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "access log %s: %s\n", config.access_log, strerror(errno));
+      return;  // these lines are lost
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/* Drain every ring into the file, LOG_BATCH bytes per write() at most */
+static void *log_writer(void *vargp) {
+  char *buf = Malloc(LOG_BATCH);
+  unsigned head, tail;
+  size_t len;
+  log_ring *g;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    usleep(LOG_FLUSH_MS * 1000);
+    len = 0;
+    for (g = (log_ring *)__atomic_load_n(&rings.head, __ATOMIC_ACQUIRE); g; g = (log_ring *)g->slot.next) {
+      head = __atomic_load_n(&g->head, __ATOMIC_ACQUIRE);
+      for (tail = g->tail; tail != head; tail++) {
+        if (len > LOG_BATCH - LOG_LINE) {
+          log_write(buf, len);
+          len = 0;
+        }
+        len += log_format(buf + len, &g->ent[tail % LOG_RING]);
+      }
+      __atomic_store_n(&g->tail, tail, __ATOMIC_RELEASE);  // the slots are free again
+    }
+    if (len > 0)
+      log_write(buf, len);
+  }
+  return NULL;
+}
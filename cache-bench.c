@@ -0,0 +1,148 @@
+/*
+ * cache-bench.c - measure cache hit throughput as reader threads are added
+ *
+ * Fills the cache with nobjs objects, then for 1, 2, 4, ... up to
+ * maxthreads threads runs cache_find()/cache_put() on random URLs for a
+ * fixed time and prints hits per second.  Run it once with -s 1 and once
+ * with more shards to compare a single lock against the sharded cache.
+ *
+ * With -r, replays that many requests on one thread instead: a Zipf mix
+ * over the nobjs urls, every other request a url never seen before (a
+ * crawler), each miss stored.  It prints the hit ratio on the Zipf urls;
+ * run it with -A tinylfu and -A all, and a -C too small for all of them,
+ * to compare the admission policies.
+ *
+ * usage: cachebench [-s shards] [-t maxthreads] [-n nobjs] [-d seconds]
+ *                   [-r requests] [-A tinylfu|all] [-C cache_bytes]
+ */
+#include "proxy.h"
+
+proxy_config config = {
+  .cache_size = 64 << 20,
+  .object_size = MAX_OBJECT_SIZE,
+  .cache_shards = CACHE_SHARDS,
+  .admission = ADMIT_TINYLFU,
+};
+Cache cache;
+
+static int nobjs = 10000;
+static volatile int stop;
+
+static void *reader(void *vargp) {
+  unsigned seed = (unsigned)(intptr_t)vargp;
+  long *hits = Malloc(sizeof(long));
+  char url[MAXLINE];
+  cache_block *b;
+
+  *hits = 0;
+  while (!stop) {
+    sprintf(url, "http://bench/%d", rand_r(&seed) % nobjs);
+    if ((b = cache_find(url)) != NULL) {
+      cache_put(b);
+      (*hits)++;
+    }
+  }
+  return hits;
+}
+
+/* Look url up, storing obj under it on a miss; 1 on a hit */
+static int request(char *url, char *obj, size_t len) {
+  cache_block *b;
+
+  if ((b = cache_find(url)) != NULL) {
+    cache_put(b);
+    return 1;
+  }
+  cache_uri(url, obj, len, 0, time(NULL) + 3600);
+  return 0;
+}
+
+static void hit_ratio(long nreqs) {
+  double *cdf = Malloc(nobjs * sizeof(double)), sum = 0, r;
+  char url[MAXLINE], obj[1024];
+  unsigned seed = 1;
+  long i, hits = 0, scan = 0;
+  int lo, hi, mid;
+
+  // Zipf with exponent 1: url k is asked for in proportion to 1/(k+1)
+  for (i = 0; i < nobjs; i++)
+    cdf[i] = (sum += 1.0 / (i + 1));
+  memset(obj, 'x', sizeof(obj));
+
+  for (i = 0; i < nreqs; i++) {
+    if (i % 2) {
+      sprintf(url, "http://scan/%ld", scan++);
+      request(url, obj, sizeof(obj));
+      continue;
+    }
+    r = rand_r(&seed) / (RAND_MAX + 1.0) * sum;
+    for (lo = 0, hi = nobjs - 1; lo < hi; ) {
+      mid = (lo + hi) / 2;
+      if (cdf[mid] < r)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    sprintf(url, "http://bench/%d", lo);
+    hits += request(url, obj, sizeof(obj));
+  }
+  printf("%s admission, %zu byte cache: %.1f%% of zipf requests hit, %lu objects turned away\n",
+         config.admission == ADMIT_TINYLFU ? "tinylfu" : "all", config.cache_size,
+         100.0 * hits / ((nreqs + 1) / 2), cache_rejects());
+  Free(cdf);
+}
+
+int main(int argc, char **argv) {
+  int opt, i, nthreads, maxthreads = 8, seconds = 2;
+  char url[MAXLINE], obj[1024];
+  pthread_t tids[256];
+  long total, *hits, nreqs = 0;
+
+  while ((opt = getopt(argc, argv, "s:t:n:d:r:A:C:")) != -1) {
+    switch (opt) {
+    case 's': config.cache_shards = atoi(optarg); break;
+    case 't': maxthreads = atoi(optarg); break;
+    case 'n': nobjs = atoi(optarg); break;
+    case 'd': seconds = atoi(optarg); break;
+    case 'r': nreqs = atol(optarg); break;
+    case 'A': config.admission = strcmp(optarg, "all") ? ADMIT_TINYLFU : ADMIT_ALL; break;
+    case 'C': config.cache_size = strtoul(optarg, NULL, 10); break;
+    default:
+      fprintf(stderr, "usage: %s [-s shards] [-t maxthreads] [-n nobjs] [-d seconds]\n"
+                      "       [-r requests] [-A tinylfu|all] [-C cache_bytes]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (config.cache_shards <= 0 || maxthreads <= 0 || maxthreads > 256 || nobjs <= 0
+      || config.cache_size / config.cache_shards < config.object_size)
+    app_error("cachebench: bad arguments");
+
+  cache_init();
+  if (nreqs > 0) {
+    hit_ratio(nreqs);
+    exit(0);
+  }
+  memset(obj, 'x', sizeof(obj));
+  for (i = 0; i < nobjs; i++) {
+    sprintf(url, "http://bench/%d", i);
+    cache_uri(url, obj, sizeof(obj), 0, time(NULL) + 3600);
+  }
+
+  printf("%d shards, %d objects\n", config.cache_shards, nobjs);
+  for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+    stop = 0;
+    for (i = 0; i < nthreads; i++)
+      Pthread_create(&tids[i], NULL, reader, (void *)(intptr_t)(i + 1));
+    sleep(seconds);
+    stop = 1;
+
+    total = 0;
+    for (i = 0; i < nthreads; i++) {
+      Pthread_join(tids[i], (void **)&hits);
+      total += *hits;
+      Free(hits);
+    }
+    printf("%3d threads: %12.0f hits/s\n", nthreads, (double)total / seconds);
+  }
+  exit(0);
+}
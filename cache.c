@@ -0,0 +1,788 @@
+/*
+ * cache.c - the proxy's web object cache
+ *
+ * The cache is split into config.cache_shards (-s) shards picked by URL
+ * hash.  Each shard has its own index, clock ring, lock and an equal slice
+ * of the byte budget, so hits on different shards never touch the same
+ * lock and an insert only excludes readers of one shard.
+ *
+ * Each cached object is one allocation holding its block header, its
+ * normalized URL and its bytes, so it costs what it weighs.  A shard's
+ * size tracks the bytes it holds against its slice of config.cache_size
+ * (-C), and cache_uri() evicts until the new object fits; objects over
+ * config.object_size (-O) are never stored in memory.  Objects are arbitrary bytes with an explicit length,
+ * and a block never changes once it is in the cache: storing a URL again
+ * replaces its block.
+ *
+ * Blocks are reference counted.  The cache holds one reference, and
+ * cache_find() hands the caller another, so a hit is served straight out
+ * of the block with no lock held; cache_put() drops it.  An evicted block
+ * is freed when its last reader lets go.
+ *
+ * Blocks are found through a hash index keyed by the normalized URL, so a
+ * lookup costs one read-lock acquisition and one bucket walk no matter how
+ * many blocks the cache has.  A shard's reader-writer lock covers its
+ * index and ring: lookups share it only long enough to take a reference,
+ * and cache_uri() takes it exclusively.  The lock prefers writers, so a
+ * stream of hits cannot starve inserts.
+ *
+ * Replacement is CLOCK: a hit only sets the block's reference bit, which
+ * is safe under the shared lock, and cache_victim() sweeps a hand round
+ * the ring of blocks, clearing set bits and taking the first block whose
+ * bit is already clear.  Each hit and each eviction costs O(1) amortized,
+ * and recently read blocks survive a full sweep of the hand.
+ *
+ * Admission is TinyLFU unless -A all: every lookup, hit or miss, counts
+ * towards its URL's popularity in a per-shard count-min sketch of small
+ * saturating counters, all halved once the shard has seen ten accesses per
+ * counter so that old popularity fades.  A new object that needs room only
+ * gets in if it is estimated to be more popular than each block the clock
+ * would evict for it; otherwise those blocks stay and it is not stored.
+ * A crawl of URLs seen once no longer flushes the hot set.
+ *
+ * With -D, evicted blocks, and objects too big for memory, go on to the
+ * disk tier (disk.c), which cache_find() falls back to on a miss.
+ *
+ * With -S, cache_snapshot() saves the memory tier, shard by shard in clock
+ * order from the hand, and cache_init() restores it at the next start.
+ * The snapshot is mapped rather than read: restored blocks point into the
+ * mapping, so startup only walks record headers, and each object's
+ * checksum is verified the first time it is hit.
+ */
+#define _GNU_SOURCE  /* pthread_rwlockattr_setkind_np */
+#include "proxy.h"
+#include <stdint.h>
+
+#define CACHE_MIN_BUCKETS 64
+
+#define SKETCH_ROWS 4
+#define SKETCH_MAX  15    /* counters saturate here, like 4-bit ones */
+#define SKETCH_MIN  1024  /* counters per row at least */
+
+#define SNAP_MAGIC   0x50414e53  /* "SNAP" */
+#define SNAP_VERSION 2
+
+/* Start of a snapshot file */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t nobjs;
+} snap_hdr;
+
+/* Start of each object in it; the NUL-terminated key and the object follow */
+typedef struct {
+  uint32_t key_len;
+  uint32_t ref;        // the block's reference bit
+  uint64_t obj_len;
+  uint64_t head_len;
+  uint64_t sum;        // obj_sum() of the object
+  int64_t expires;
+} snap_rec;
+
+static cache_shard *shard_of(unsigned long h);
+static cache_block *index_lookup(cache_shard *s, const char *key, unsigned long h);
+static void index_insert(cache_shard *s, cache_block *b);
+static void index_unlink(cache_shard *s, cache_block *b);
+static void index_grow(cache_shard *s);
+static void ring_insert(cache_shard *s, cache_block *b);
+static void ring_unlink(cache_shard *s, cache_block *b);
+static cache_block *cache_victim(cache_shard *s);
+static void cache_remove(cache_shard *s, cache_block *b);
+static void cache_evict(cache_shard *s, cache_block *b);
+static int cache_verify(cache_shard *s, cache_block *b);
+static void cache_restore();
+static int sync_dir(const char *path);
+static void sketch_init(cache_shard *s);
+static void sketch_add(cache_shard *s, unsigned long h);
+static int sketch_estimate(cache_shard *s, unsigned long h);
+static int cache_admit(cache_shard *s, cache_block *b, cache_block **spill);
+
+void cache_init() {
+  pthread_rwlockattr_t attr;
+  cache_shard *s;
+  int i;
+
+  // writers must not starve behind a steady stream of hits
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+  cache.nshards = config.cache_shards;
+  if (posix_memalign((void **)&cache.shards, __alignof__(cache_shard),
+                     cache.nshards * sizeof(cache_shard)) != 0)
+    app_error("cache_init: out of memory");
+  for (i = 0; i < cache.nshards; i++) {
+    s = &cache.shards[i];
+    s->nbuckets = CACHE_MIN_BUCKETS;
+    s->buckets = Calloc(s->nbuckets, sizeof(cache_block *));
+    s->hand = NULL;
+    s->size = 0;
+    s->max_size = config.cache_size / cache.nshards;
+    s->nobjs = 0;
+    s->admit_rejects = 0;
+    s->evictions = 0;
+    sketch_init(s);
+    pthread_rwlock_init(&s->lock, &attr);
+  }
+  pthread_rwlockattr_destroy(&attr);
+  disk_init();
+  if (config.snapshot_path)
+    cache_restore();
+}
+
+/*
+ * cache_key - normalize url so that spellings of the same object share an
+ *     entry: lower-case scheme and host, no default port, no fragment, and
+ *     "/" for an empty path.
+ */
+void cache_key(const char *url, char *key) {
+  const char *p = url, *s;
+  char *k = key, *end = key + MAXLINE - 3;  // room for ":", "/" and the NUL
+
+  if ((s = strstr(p, "://")) != NULL) {
+    for (; p < s + 3 && k < end; p++)
+      *k++ = tolower((unsigned char)*p);
+
+    // host
+    for (; *p && *p != ':' && *p != '/' && *p != '?' && *p != '#' && k < end; p++)
+      *k++ = tolower((unsigned char)*p);
+
+    // port, dropped when it is the default
+    if (*p == ':') {
+      if (strncmp(p, ":80", 3) == 0 && !isdigit((unsigned char)p[3])) {
+        p += 3;
+      } else {
+        for (*k++ = *p++; isdigit((unsigned char)*p) && k < end; p++)
+          *k++ = *p;
+      }
+    }
+    if (*p != '/')
+      *k++ = '/';
+  }
+
+  // path and query, up to any fragment
+  for (; *p && *p != '#' && k < end; p++)
+    *k++ = *p;
+  *k = '\0';
+}
+
+/* FNV-1a */
+unsigned long url_hash(const char *key) {
+  unsigned long h = 14695981039346656037UL;
+
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+/* Shards use the high bits of the hash, buckets the low ones */
+static cache_shard *shard_of(unsigned long h) {
+  return &cache.shards[(h >> 32) % cache.nshards];
+}
+
+/*
+ * cache_find - look up url.  On a hit, return its block with a reference
+ *     held for the caller, who must cache_put() it when done.  On a miss,
+ *     try the disk tier, then return NULL.
+ */
+cache_block *cache_find(char *url) {
+  char key[MAXLINE];
+  unsigned long h;
+  cache_shard *s;
+  cache_block *b;
+
+  cache_key(url, key);
+  h = url_hash(key);
+  s = shard_of(h);
+
+  if (config.admission == ADMIT_TINYLFU)
+    sketch_add(s, h);
+  pthread_rwlock_rdlock(&s->lock);
+  if ((b = index_lookup(s, key, h)) != NULL) {
+    // other readers may be setting it too, hence the atomic store
+    __atomic_store_n(&b->ref, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&s->lock);
+  if (b != NULL && b->unchecked && cache_verify(s, b) < 0) {
+    cache_put(b);
+    b = NULL;
+  }
+  if (b == NULL)
+    b = disk_find(key, h);
+  return b;
+}
+
+/* Take another reference to b, which the caller already holds one on */
+void cache_hold(cache_block *b) {
+  __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference to b, freeing it if the cache has already let go of it */
+void cache_put(cache_block *b) {
+  if (__atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  if (b->disk)
+    disk_release(b->disk);
+  Free(b);
+}
+
+/* Is b still fresh, or stale by less than grace seconds? */
+int cache_fresh(cache_block *b, long grace) {
+  return __atomic_load_n(&b->expires, __ATOMIC_RELAXED) + grace > time(NULL);
+}
+
+/*
+ * cache_refresh - the end server says b is still good (304): it is fresh
+ *     until expires.  Only the block's expiry changes, so readers sending
+ *     it are not disturbed.
+ */
+void cache_refresh(cache_block *b, time_t expires) {
+  __atomic_store_n(&b->expires, expires, __ATOMIC_RELAXED);
+  if (b->disk)  // a stub: the tier has to remember it
+    disk_refresh(b->cache_url, b->hash, expires);
+}
+
+/* Copy b's stored head into out (MAXBUF + 64 bytes) as a string, for hdr_value() */
+void cache_stem(cache_block *b, char *out) {
+  size_t n = b->head_len < MAXBUF + 63 ? b->head_len : MAXBUF + 63;
+
+  memcpy(out, b->cache_obj, n);
+  out[n] = '\0';
+}
+
+/* Largest object worth copying for the cache, in either tier */
+size_t cache_object_max() {
+  size_t n = disk_object_max();
+
+  return n > config.object_size ? n : config.object_size;
+}
+
+// cache the uri and the len bytes of content in buf, whose first head_len bytes are the response head,
+// fresh until expires
+void cache_uri(char *uri, char *buf, size_t len, size_t head_len, time_t expires) {
+  char key[MAXLINE];
+  size_t keylen, size;
+  unsigned long h;
+  cache_shard *s;
+  cache_block *b, *old, *spill = NULL;
+
+  cache_key(uri, key);
+  h = url_hash(key);
+  s = shard_of(h);
+  keylen = strlen(key);
+  size = sizeof(cache_block) + keylen + 1 + len;
+
+  // build the block before taking the lock
+  b = Malloc(size);
+  b->cache_url = (char *)(b + 1);
+  b->cache_obj = b->cache_url + keylen + 1;
+  memcpy(b->cache_url, key, keylen + 1);
+  memcpy(b->cache_obj, buf, len);
+  b->obj_len = len;
+  b->head_len = head_len;
+  b->expires = expires;
+  b->size = size;
+  b->hash = h;
+  b->ref = 0;  // has to be read before the hand comes round to keep its place
+  b->refcnt = 1;  // the cache's own reference
+  b->disk = NULL;
+  b->unchecked = 0;
+  if (len > config.object_size || size > s->max_size) {
+    // too big for memory; an older copy there would shadow it
+    pthread_rwlock_wrlock(&s->lock);
+    if ((old = index_lookup(s, key, h)) != NULL)
+      cache_evict(s, old);
+    pthread_rwlock_unlock(&s->lock);
+    disk_store(b);
+    return;
+  }
+
+  pthread_rwlock_wrlock(&s->lock);
+
+  // another request may have stored the same url while we were fetching it
+  if ((old = index_lookup(s, key, b->hash)) != NULL)
+    cache_evict(s, old);
+  if (old == NULL && config.admission == ADMIT_TINYLFU) {
+    if (cache_admit(s, b, &spill) < 0) {
+      s->admit_rejects++;
+      pthread_rwlock_unlock(&s->lock);
+      Free(b);
+      return;
+    }
+  }
+  while (s->size + size > s->max_size) {
+    old = cache_victim(s);
+    cache_remove(s, old);
+    old->next = spill;  // off the ring now, so the link is free
+    spill = old;
+  }
+  for (old = spill; old; old = old->next)
+    s->evictions++;
+
+  index_insert(s, b);
+  ring_insert(s, b);
+  s->size += size;
+  s->nobjs++;
+  if (s->nobjs > s->nbuckets)
+    index_grow(s);
+
+  pthread_rwlock_unlock(&s->lock);
+
+  // queued for the disk writer once the shard is unlocked; it drops the cache's references
+  disk_forget(key, h);  // an older copy there mustn't outlive this one
+  while ((old = spill) != NULL) {
+    spill = old->next;
+    disk_store(old);
+  }
+}
+
+/*******************************
+ * Hash index, shard write-locked
+ * (index_lookup: either lock)
+ *******************************/
+static cache_block *index_lookup(cache_shard *s, const char *key, unsigned long h) {
+  cache_block *b;
+
+  for (b = s->buckets[h & (s->nbuckets - 1)]; b; b = b->hnext) {
+    if (b->hash == h && strcmp(key, b->cache_url) == 0)
+      return b;
+  }
+  return NULL;
+}
+
+static void index_insert(cache_shard *s, cache_block *b) {
+  cache_block **bucket = &s->buckets[b->hash & (s->nbuckets - 1)];
+
+  b->hnext = *bucket;
+  *bucket = b;
+}
+
+static void index_unlink(cache_shard *s, cache_block *b) {
+  cache_block **pp = &s->buckets[b->hash & (s->nbuckets - 1)];
+
+  while (*pp != b)
+    pp = &(*pp)->hnext;
+  *pp = b->hnext;
+  b->hnext = NULL;
+}
+
+/* Double the bucket array so chains stay around one block long */
+static void index_grow(cache_shard *s) {
+  cache_block **old = s->buckets, *b, *next;
+  unsigned i, n = s->nbuckets;
+
+  s->nbuckets = 2 * n;
+  s->buckets = Calloc(s->nbuckets, sizeof(cache_block *));
+  for (i = 0; i < n; i++) {
+    for (b = old[i]; b; b = next) {
+      next = b->hnext;
+      index_insert(s, b);
+    }
+  }
+  Free(old);
+}
+
+/*******************************
+ * Clock ring, shard write-locked
+ *******************************/
+
+/* New blocks go just behind the hand, the last place it will reach */
+static void ring_insert(cache_shard *s, cache_block *b) {
+  if (s->hand == NULL) {
+    b->prev = b->next = b;
+    s->hand = b;
+    return;
+  }
+  b->next = s->hand;
+  b->prev = s->hand->prev;
+  b->prev->next = b;
+  s->hand->prev = b;
+}
+
+static void ring_unlink(cache_shard *s, cache_block *b) {
+  if (b->next == b) {
+    s->hand = NULL;
+    return;
+  }
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  if (s->hand == b)
+    s->hand = b->next;
+}
+
+/* Advance the hand to a block not read since the last sweep (at most two sweeps) */
+static cache_block *cache_victim(cache_shard *s) {  // 캐시 쫓아내기
+  cache_block *b;
+
+  while (1) {
+    b = s->hand;
+    s->hand = b->next;
+    if (!b->ref)
+      return b;
+    b->ref = 0;  // second chance
+  }
+}
+
+/*
+ * cache_admit - make room for b, unless one of the blocks that would go
+ *     for it is more popular.  Returns 0 with the victims on *spill, or -1
+ *     with them put back behind the hand.
+ */
+static int cache_admit(cache_shard *s, cache_block *b, cache_block **spill) {
+  int freq = sketch_estimate(s, b->hash), lost = 0;
+  cache_block *old, *victims = NULL;
+
+  while (!lost && s->size + b->size > s->max_size) {
+    old = cache_victim(s);
+    cache_remove(s, old);
+    old->next = victims;
+    victims = old;
+    lost = sketch_estimate(s, old->hash) >= freq;
+  }
+  if (!lost) {
+    while ((old = victims) != NULL) {
+      victims = old->next;
+      old->next = *spill;
+      *spill = old;
+    }
+    return 0;
+  }
+
+  while ((old = victims) != NULL) {
+    victims = old->next;
+    index_insert(s, old);
+    ring_insert(s, old);
+    s->size += old->size;
+    s->nobjs++;
+  }
+  return -1;
+}
+
+/* Take b out of the shard; the caller still has the cache's reference */
+static void cache_remove(cache_shard *s, cache_block *b) {
+  index_unlink(s, b);
+  ring_unlink(s, b);
+  s->size -= b->size;
+  s->nobjs--;
+}
+
+static void cache_evict(cache_shard *s, cache_block *b) {
+  cache_remove(s, b);
+  cache_put(b);  // readers still sending it keep it alive
+}
+
+/*******************************
+ * Popularity sketch (TinyLFU);
+ * counters are updated without the
+ * lock, so estimates are approximate
+ *******************************/
+
+static void sketch_init(cache_shard *s) {
+  size_t n = SKETCH_MIN;
+
+  while (n < s->max_size / SKETCH_OBJ)
+    n *= 2;
+  s->sketch = Calloc(SKETCH_ROWS * n, 1);
+  s->sketch_mask = n - 1;
+  s->sketch_adds = 0;
+}
+
+/* The counter for h in row i: each row hashes h its own way */
+static unsigned char *sketch_counter(cache_shard *s, unsigned long h, int i) {
+  static const unsigned long seeds[SKETCH_ROWS] = {
+    0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL, 0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL
+  };
+  unsigned long x = (h ^ (h >> 31)) * seeds[i];
+
+  return &s->sketch[i * (s->sketch_mask + 1) + ((x >> 32) & s->sketch_mask)];
+}
+
+static void sketch_add(cache_shard *s, unsigned long h) {
+  unsigned char *c;
+  unsigned n = s->sketch_mask + 1, i;
+
+  for (i = 0; i < SKETCH_ROWS; i++) {
+    c = sketch_counter(s, h, i);
+    if (__atomic_load_n(c, __ATOMIC_RELAXED) < SKETCH_MAX)
+      __atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+  }
+  // aging: the access that completes a sample halves every counter
+  if (__atomic_add_fetch(&s->sketch_adds, 1, __ATOMIC_RELAXED) == 10 * n) {
+    for (i = 0; i < SKETCH_ROWS * n; i++)
+      s->sketch[i] >>= 1;
+    __atomic_store_n(&s->sketch_adds, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/* Accesses to h lately: the smallest of its counters */
+static int sketch_estimate(cache_shard *s, unsigned long h) {
+  int i, v, min = SKETCH_MAX;
+
+  for (i = 0; i < SKETCH_ROWS; i++) {
+    v = __atomic_load_n(sketch_counter(s, h, i), __ATOMIC_RELAXED);
+    if (v < min)
+      min = v;
+  }
+  return min;
+}
+
+/* Blocks evicted to make room so far */
+unsigned long cache_evictions() {
+  unsigned long n = 0;
+  int i;
+
+  for (i = 0; i < cache.nshards; i++)
+    n += __atomic_load_n(&cache.shards[i].evictions, __ATOMIC_RELAXED);
+  return n;
+}
+
+/* New objects turned away by admission so far */
+unsigned long cache_rejects() {
+  unsigned long n = 0;
+  int i;
+
+  for (i = 0; i < cache.nshards; i++)
+    n += __atomic_load_n(&cache.shards[i].admit_rejects, __ATOMIC_RELAXED);
+  return n;
+}
+
+/*******************************
+ * Snapshots (-S)
+ *******************************/
+
+/* FNV-1a over n bytes */
+static unsigned long obj_sum(const char *p, size_t n) {
+  unsigned long h = 14695981039346656037UL;
+
+  while (n-- > 0) {
+    h ^= (unsigned char)*p++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+/*
+ * cache_snapshot - save every block in memory to config.snapshot_path,
+ *     with its reference bit, each shard in order from the hand so a
+ *     restore puts the ring back as it was.  Written to a temporary file
+ *     and renamed over the old one, so a snapshot that is mapped by the
+ *     running proxy stays intact.  Returns 0, or -1 on error.
+ */
+int cache_snapshot() {
+  char tmp[MAXLINE], pad[8] = {0};
+  cache_block **v, *b;
+  cache_shard *s;
+  snap_hdr hdr;
+  snap_rec r;
+  size_t keylen, padlen;
+  unsigned i, nv;
+  int k, rc = 0;
+  FILE *fp;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", config.snapshot_path);
+  if ((fp = fopen(tmp, "w")) == NULL)
+    return -1;
+  hdr.magic = SNAP_MAGIC;
+  hdr.version = SNAP_VERSION;
+  hdr.nobjs = 0;
+  fwrite(&hdr, sizeof(hdr), 1, fp);  // nobjs is filled in at the end
+
+  for (k = 0; k < cache.nshards; k++) {
+    s = &cache.shards[k];
+
+    // hold references and write without the lock; hits carry on meanwhile
+    pthread_rwlock_rdlock(&s->lock);
+    v = Malloc((s->nobjs + 1) * sizeof(cache_block *));
+    nv = 0;
+    if ((b = s->hand) != NULL) {
+      do {
+        __atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+        v[nv++] = b;
+      } while ((b = b->next) != s->hand);
+    }
+    pthread_rwlock_unlock(&s->lock);
+
+    for (i = 0; i < nv; i++) {
+      b = v[i];
+      keylen = strlen(b->cache_url);
+      r.key_len = keylen;
+      r.ref = __atomic_load_n(&b->ref, __ATOMIC_RELAXED);
+      r.obj_len = b->obj_len;
+      r.head_len = b->head_len;
+      r.sum = b->unchecked ? b->sum : obj_sum(b->cache_obj, b->obj_len);
+      r.expires = __atomic_load_n(&b->expires, __ATOMIC_RELAXED);
+      padlen = (8 - (sizeof(r) + keylen + 1 + b->obj_len) % 8) % 8;  // next record 8-aligned
+      if (fwrite(&r, sizeof(r), 1, fp) != 1 || fwrite(b->cache_url, keylen + 1, 1, fp) != 1
+          || (b->obj_len > 0 && fwrite(b->cache_obj, b->obj_len, 1, fp) != 1)
+          || (padlen > 0 && fwrite(pad, padlen, 1, fp) != 1))
+        rc = -1;
+      hdr.nobjs++;
+      cache_put(b);
+    }
+    Free(v);
+  }
+
+  // on disk before the rename, so a crash can't leave a short file under the real name
+  if (rc == 0 && (fseek(fp, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+                  || fflush(fp) != 0 || fsync(fileno(fp)) < 0))
+    rc = -1;
+  if (fclose(fp) != 0 || rc < 0 || rename(tmp, config.snapshot_path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return sync_dir(config.snapshot_path);
+}
+
+/* fsync the directory path is in, so a rename into it is on disk too */
+static int sync_dir(const char *path) {
+  char dir[MAXLINE], *slash;
+  int fd, rc;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  if ((slash = strrchr(dir, '/')) == NULL)
+    strcpy(dir, ".");
+  else if (slash == dir)
+    dir[1] = '\0';
+  else
+    *slash = '\0';
+  if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    return -1;
+  rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+/*
+ * Map config.snapshot_path, if there is one, and put its objects back in
+ * the cache in the order they were saved.  Only the record headers are
+ * read here; cache_verify() checks each object on its first hit.  The map
+ * is kept for the life of the process.
+ */
+static void cache_restore() {
+  struct stat st;
+  char *map, *p, *end, *key;
+  snap_hdr *hdr;
+  snap_rec *r;
+  cache_block *b;
+  cache_shard *s;
+  size_t size;
+  uint64_t i;
+  int fd;
+
+  if ((fd = open(config.snapshot_path, O_RDONLY | O_CLOEXEC)) < 0)
+    return;  // nothing saved yet
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_hdr)
+      || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+  close(fd);
+
+  hdr = (snap_hdr *)map;
+  if (hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION) {
+    fprintf(stderr, "%s: not a cache snapshot, ignored\n", config.snapshot_path);
+    munmap(map, st.st_size);
+    return;
+  }
+  p = map + sizeof(snap_hdr);
+  end = map + st.st_size;
+  for (i = 0; i < hdr->nobjs && p + sizeof(snap_rec) <= end; i++) {
+    r = (snap_rec *)p;
+    key = (char *)(r + 1);
+    size = sizeof(snap_rec) + r->key_len + 1 + r->obj_len;
+    if (r->key_len >= MAXLINE || r->obj_len > (size_t)(end - key) || size > (size_t)(end - p)
+        || key[r->key_len] != '\0' || r->head_len > r->obj_len)
+      break;  // truncated or damaged: keep what came before
+    p += (size + 7) & ~(size_t)7;
+    if (r->obj_len > config.object_size)
+      continue;
+
+    b = Malloc(sizeof(cache_block));
+    b->cache_url = key;
+    b->cache_obj = key + r->key_len + 1;
+    b->obj_len = r->obj_len;
+    b->head_len = r->head_len;
+    b->expires = r->expires;
+    b->size = sizeof(cache_block) + r->key_len + 1 + r->obj_len;
+    b->hash = url_hash(key);
+    b->ref = r->ref;
+    b->refcnt = 1;
+    b->disk = NULL;
+    b->unchecked = 1;
+    b->sum = r->sum;
+
+    // only startup is running, but the shard's invariants still hold
+    s = shard_of(b->hash);
+    if (s->size + b->size > s->max_size || index_lookup(s, key, b->hash) != NULL) {
+      Free(b);  // -C is smaller than when it was saved
+      continue;
+    }
+    index_insert(s, b);
+    ring_insert(s, b);
+    s->size += b->size;
+    s->nobjs++;
+    if (s->nobjs > s->nbuckets)
+      index_grow(s);
+  }
+}
+
+/* First hit on a restored block: check its bytes, and drop it if they are bad */
+static int cache_verify(cache_shard *s, cache_block *b) {
+  if (obj_sum(b->cache_obj, b->obj_len) == b->sum) {
+    __atomic_store_n(&b->unchecked, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  pthread_rwlock_wrlock(&s->lock);
+  if (index_lookup(s, b->cache_url, b->hash) == b)
+    cache_evict(s, b);
+  pthread_rwlock_unlock(&s->lock);
+  return -1;
+}
+
+/*******************************
+ * Response copies for the cache
+ *******************************/
+void tee_init(cache_tee *t) {
+  t->buf = NULL;
+  t->len = t->cap = 0;
+  t->toobig = 0;
+}
+
+/* Append n bytes, giving up on the copy once it outgrows cache_object_max() */
+void tee_append(cache_tee *t, char *data, size_t n) {
+  if (t->toobig)
+    return;
+  if (t->len + n > cache_object_max()) {
+    tee_drop(t);
+    return;
+  }
+  if (t->len + n > t->cap) {
+    t->cap = t->cap ? 2 * t->cap : MAXBUF;
+    while (t->cap < t->len + n)
+      t->cap *= 2;
+    t->buf = Realloc(t->buf, t->cap);
+  }
+  memcpy(t->buf + t->len, data, n);
+  t->len += n;
+}
+
+/* The copy will come to total bytes: give up now if that won't fit */
+void tee_expect(cache_tee *t, size_t total) {
+  if (total > cache_object_max())
+    tee_drop(t);
+}
+
+/* The response won't be cached after all: stop copying it */
+void tee_drop(cache_tee *t) {
+  tee_free(t);
+  t->toobig = 1;
+}
+
+void tee_free(cache_tee *t) {
+  if (t->buf)
+    Free(t->buf);
+  t->buf = NULL;
+  t->len = t->cap = 0;
+}
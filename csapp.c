@@ -891,8 +891,6 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
     2. 0 (EOF) : 파일에 대한 write 호출에서 0이 반환될 일은 거의 없습니다. 그러나 일반적으로 소켓이나 파이프에서 상대방이 연결을 종료한 상태라면 0을 반환할 수 있습니다.
     3. 음수 값(-1) : 오류 발생
     */
-   .0
-   20.
 }
 /* $end rio_writen */
 
@@ -1159,6 +1157,12 @@ int open_clientfd(char *hostname, char *port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port) 
+{
+    return open_listenfd_backlog(port, LISTENQ);
+}
+
+/* open_listenfd with backlog pending connections queued instead of LISTENQ */
+int open_listenfd_backlog(char *port, int backlog)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1199,7 +1203,7 @@ int open_listenfd(char *port)
         return -1;
 
     /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0) {
+    if (listen(listenfd, backlog) < 0) {
         close(listenfd);
 	return -1;
     }
@@ -1228,6 +1232,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_backlog(char *port, int backlog) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_backlog(port, backlog)) < 0)
+	unix_error("Open_listenfd error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
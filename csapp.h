@@ -69,6 +69,8 @@ extern char **environ; /* Defined by libc */
 
 /* Our own error-handling functions */
 /* 에러 핸들링 함수 */
+/* glibc declares its own gai_error() under _GNU_SOURCE, so ours is renamed */
+#define gai_error csapp_gai_error
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
 void dns_error(char *msg);
@@ -230,10 +232,12 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
+int open_listenfd_backlog(char *port, int backlog);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_listenfd_backlog(char *port, int backlog);
 
 
 #endif /* __CSAPP_H__ */
@@ -0,0 +1,499 @@
+/*
+ * disk.c - on-disk second tier of the cache (-D)
+ *
+ * Objects evicted from memory, and ones too big for it (over -O) that
+ * still fit in a segment, are appended to a log file of config.disk_size
+ * bytes (-Z) cut into DISK_SEGMENT-byte segments.  Segments fill one after
+ * another and are reused oldest first; reusing one drops everything in it
+ * from the index, so the tier is FIFO by segment and never fragments.
+ *
+ * The file is mapped once, shared and read-only.  A disk hit is a stub
+ * cache_block whose cache_obj points into the mapping, so it goes out
+ * like any other block, straight from the page cache, and costs no heap
+ * for the object.  The stub holds a reference on its segment, which is
+ * not reused until the last one is dropped.
+ *
+ * Every segment starts with a header carrying its generation, and every
+ * record carries the generation of the segment it was written into.  At
+ * startup the index is rebuilt by hopping from record header to record
+ * header, segments in generation order so the newest copy of a url wins;
+ * a scan stops at the first record left over from a segment's previous
+ * life.  A record's header is written after its bytes, so one cut short
+ * by a crash is never taken for an object.
+ *
+ * Stores, refreshes and forgets are queued, in order, for one writer
+ * thread, so the requests that cause them (and the event loops above
+ * all) never wait on the disk.  Stores are dropped, not queued, once
+ * DISK_QUEUE_BYTES of objects are waiting: the tier falls behind rather
+ * than memory filling up with them.
+ */
+#include "proxy.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISK_SEG_MAGIC 0x53505844  /* "DXPS" */
+#define DISK_REC_MAGIC 0x32505844  /* "DXP2" */
+#define DISK_MIN_BUCKETS 1024
+
+/* Queued work for disk_writer() */
+#define DISK_STORE   0
+#define DISK_REFRESH 1
+#define DISK_FORGET  2
+
+/* Start of each segment */
+typedef struct {
+  uint32_t magic;
+  uint32_t pad;
+  uint64_t gen;
+} seg_hdr;
+
+/* Start of each record; the NUL-terminated key and the object follow */
+typedef struct {
+  uint32_t magic;
+  uint32_t key_len;
+  uint64_t gen;
+  uint64_t obj_len;
+  uint64_t head_len;
+  int64_t expires;
+} rec_hdr;
+
+/* Where a url's object is on disk */
+typedef struct disk_entry {
+  char *key;
+  unsigned long hash;
+  size_t off;                // of its record in the file
+  size_t obj_len, head_len;
+  time_t expires;
+  struct disk_seg *seg;
+  struct disk_entry *hnext;  // same bucket
+  struct disk_entry *sprev, *snext;  // same segment
+} disk_entry;
+
+struct disk_seg {
+  size_t base;          // offset in the file
+  uint64_t gen;         // 0 if never written
+  size_t used;          // bytes filled, header included
+  int refcnt;           // stubs reading it and stores writing it
+  disk_entry *entries;
+};
+
+static int disk_fd = -1;
+static char *disk_map;  // NULL if the tier is off
+static disk_seg *segs;
+static int nsegs, cur;  // segs[cur] is being filled
+static uint64_t disk_gen;
+static disk_entry **buckets;
+static unsigned nbuckets;
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct disk_job {
+  int op;                // DISK_*
+  cache_block *b;        // DISK_STORE: written, then its reference dropped
+  char *key;             // DISK_REFRESH, DISK_FORGET
+  unsigned long hash;
+  time_t expires;        // DISK_REFRESH
+  struct disk_job *next;
+} disk_job;
+
+static disk_job *job_head, *job_tail;
+static size_t queued_bytes;  // objects waiting in DISK_STORE jobs
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+static void *disk_writer(void *vargp);
+static void disk_write(const char *key, unsigned long h, char *obj, size_t len, size_t head_len,
+                       time_t expires);
+static void disk_write_expires(const char *key, unsigned long h, time_t expires);
+static void disk_drop(const char *key, unsigned long h);
+static void disk_scan(disk_seg *s);
+static int disk_reuse(int i);
+static void entry_add(disk_seg *s, const char *key, unsigned long h, size_t off,
+                      size_t obj_len, size_t head_len, time_t expires);
+static disk_entry *entry_lookup(const char *key, unsigned long h);
+static void entry_drop(disk_entry *e);
+
+/* Bytes a record of a keylen-byte key and a len-byte object takes, kept 8-aligned */
+static size_t rec_size(size_t keylen, size_t len) {
+  return (sizeof(rec_hdr) + keylen + 1 + len + 7) & ~(size_t)7;
+}
+
+static int seg_cmp(const void *a, const void *b) {
+  uint64_t x = (*(disk_seg **)a)->gen, y = (*(disk_seg **)b)->gen;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Open and map config.disk_path and rebuild the index from it */
+void disk_init() {
+  disk_seg **order;
+  struct stat st;
+  seg_hdr *sh;
+  pthread_t tid;
+  int i;
+
+  if (config.disk_path == NULL)
+    return;
+  nsegs = config.disk_size / DISK_SEGMENT;
+  if (nsegs < 2)
+    app_error("disk_init: -Z must allow at least two segments");
+  if ((disk_fd = open(config.disk_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+    unix_error("disk_init: open error");
+  if (fstat(disk_fd, &st) < 0)
+    unix_error("disk_init: fstat error");
+  if ((size_t)st.st_size != (size_t)nsegs * DISK_SEGMENT
+      && ftruncate(disk_fd, (off_t)nsegs * DISK_SEGMENT) < 0)
+    unix_error("disk_init: ftruncate error");
+  disk_map = mmap(NULL, (size_t)nsegs * DISK_SEGMENT, PROT_READ, MAP_SHARED, disk_fd, 0);
+  if (disk_map == MAP_FAILED)
+    unix_error("disk_init: mmap error");
+
+  // about one bucket per 16 KB of disk
+  for (nbuckets = DISK_MIN_BUCKETS; nbuckets < config.disk_size / 16384; nbuckets *= 2)
+    ;
+  buckets = Calloc(nbuckets, sizeof(disk_entry *));
+
+  segs = Calloc(nsegs, sizeof(disk_seg));
+  order = Malloc(nsegs * sizeof(disk_seg *));
+  for (i = 0; i < nsegs; i++) {
+    segs[i].base = (size_t)i * DISK_SEGMENT;
+    sh = (seg_hdr *)(disk_map + segs[i].base);
+    if (sh->magic == DISK_SEG_MAGIC)
+      segs[i].gen = sh->gen;
+    order[i] = &segs[i];
+  }
+  qsort(order, nsegs, sizeof(disk_seg *), seg_cmp);
+  for (i = 0; i < nsegs; i++) {
+    if (order[i]->gen == 0)
+      continue;
+    disk_scan(order[i]);
+    cur = order[i] - segs;
+    disk_gen = order[i]->gen;
+  }
+  Free(order);
+
+  if (disk_gen == 0 && disk_reuse(0) < 0)  // a new file
+    unix_error("disk_init: write error");
+  Pthread_create(&tid, NULL, disk_writer, NULL);
+}
+
+/* Index the records in s, up to the first that isn't from its current generation */
+static void disk_scan(disk_seg *s) {
+  size_t off = sizeof(seg_hdr), n;
+  rec_hdr *r;
+  char *key;
+
+  while (off + sizeof(rec_hdr) <= DISK_SEGMENT) {
+    r = (rec_hdr *)(disk_map + s->base + off);
+    if (r->magic != DISK_REC_MAGIC || r->gen != s->gen || r->key_len == 0 || r->key_len >= MAXLINE
+        || r->obj_len > DISK_SEGMENT || r->head_len > r->obj_len)
+      break;
+    n = rec_size(r->key_len, r->obj_len);
+    key = (char *)(r + 1);
+    if (off + n > DISK_SEGMENT || key[r->key_len] != '\0')
+      break;
+    entry_add(s, key, url_hash(key), s->base + off, r->obj_len, r->head_len, r->expires);
+    off += n;
+  }
+  s->used = off;
+}
+
+/*
+ * disk_find - look up the normalized url key (hash h) on disk.  On a hit,
+ *     return a block for it that the caller must cache_put(), else NULL.
+ */
+cache_block *disk_find(const char *key, unsigned long h) {
+  size_t keylen = strlen(key), off, obj_len, head_len;
+  time_t expires;
+  disk_entry *e;
+  disk_seg *s;
+  cache_block *b;
+
+  if (disk_map == NULL)
+    return NULL;
+  pthread_mutex_lock(&disk_mutex);
+  if ((e = entry_lookup(key, h)) == NULL) {
+    pthread_mutex_unlock(&disk_mutex);
+    return NULL;
+  }
+  s = e->seg;
+  s->refcnt++;
+  off = e->off;
+  obj_len = e->obj_len;
+  head_len = e->head_len;
+  expires = e->expires;
+  pthread_mutex_unlock(&disk_mutex);
+
+  b = Malloc(sizeof(cache_block) + keylen + 1);
+  b->cache_url = (char *)(b + 1);
+  memcpy(b->cache_url, key, keylen + 1);
+  b->cache_obj = disk_map + off + sizeof(rec_hdr) + keylen + 1;
+  b->obj_len = obj_len;
+  b->head_len = head_len;
+  b->expires = expires;
+  b->hash = h;
+  b->size = 0;
+  b->ref = 0;
+  b->refcnt = 1;  // the caller's; the cache never holds a stub
+  b->disk = s;
+  b->unchecked = 0;
+  b->hnext = b->prev = b->next = NULL;
+  return b;
+}
+
+/* A disk hit is done with its segment (from cache_put()) */
+void disk_release(disk_seg *s) {
+  pthread_mutex_lock(&disk_mutex);
+  s->refcnt--;
+  pthread_mutex_unlock(&disk_mutex);
+}
+
+/* Queue j for the writer; a store is dropped if too much is waiting already */
+static void disk_queue(disk_job *j) {
+  pthread_mutex_lock(&job_mutex);
+  if (j->op == DISK_STORE) {
+    if (queued_bytes + j->b->obj_len > DISK_QUEUE_BYTES) {
+      pthread_mutex_unlock(&job_mutex);
+      cache_put(j->b);
+      Free(j);
+      return;
+    }
+    queued_bytes += j->b->obj_len;
+  }
+  j->next = NULL;
+  if (job_tail)
+    job_tail->next = j;
+  else
+    job_head = j;
+  job_tail = j;
+  pthread_cond_signal(&job_cond);
+  pthread_mutex_unlock(&job_mutex);
+}
+
+/* Queue a refresh or a forget of key */
+static void disk_queue_key(int op, const char *key, unsigned long h, time_t expires) {
+  disk_job *j = Malloc(sizeof(disk_job));
+
+  j->op = op;
+  j->key = strdup(key);
+  j->hash = h;
+  j->expires = expires;
+  disk_queue(j);
+}
+
+/*
+ * disk_store - queue block b, an object the memory tier evicted or can't
+ *     hold, to be appended to disk, replacing any older copy.  Takes over
+ *     the caller's reference to b.  Objects bigger than a segment, and
+ *     ones whose turn comes while the segment due for reuse is still
+ *     being read, are not stored.
+ */
+void disk_store(cache_block *b) {
+  disk_job *j;
+
+  if (disk_map == NULL || rec_size(strlen(b->cache_url), b->obj_len) > DISK_SEGMENT - sizeof(seg_hdr)) {
+    cache_put(b);
+    return;
+  }
+  j = Malloc(sizeof(disk_job));
+  j->op = DISK_STORE;
+  j->b = b;
+  j->key = NULL;
+  disk_queue(j);
+}
+
+/* key's copy on disk was revalidated: fresh until expires, in the index and the record */
+void disk_refresh(const char *key, unsigned long h, time_t expires) {
+  if (disk_map != NULL)
+    disk_queue_key(DISK_REFRESH, key, h, expires);
+}
+
+/* Drop key's copy on disk, if any: a newer one is in memory */
+void disk_forget(const char *key, unsigned long h) {
+  if (disk_map != NULL)
+    disk_queue_key(DISK_FORGET, key, h, 0);
+}
+
+/* Largest object disk_store() takes, 0 if the tier is off */
+size_t disk_object_max() {
+  if (disk_map == NULL)
+    return 0;
+  return DISK_SEGMENT - sizeof(seg_hdr) - rec_size(MAXLINE, 0);
+}
+
+static void *disk_writer(void *vargp) {
+  disk_job *j;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    pthread_mutex_lock(&job_mutex);
+    while (job_head == NULL)
+      pthread_cond_wait(&job_cond, &job_mutex);
+    j = job_head;
+    if ((job_head = j->next) == NULL)
+      job_tail = NULL;
+    if (j->op == DISK_STORE)
+      queued_bytes -= j->b->obj_len;
+    pthread_mutex_unlock(&job_mutex);
+
+    switch (j->op) {
+    case DISK_STORE:
+      disk_write(j->b->cache_url, j->b->hash, j->b->cache_obj, j->b->obj_len, j->b->head_len,
+                 j->b->expires);
+      cache_put(j->b);
+      break;
+    case DISK_REFRESH:
+      disk_write_expires(j->key, j->hash, j->expires);
+      break;
+    case DISK_FORGET:
+      disk_drop(j->key, j->hash);
+      break;
+    }
+    if (j->key)
+      Free(j->key);
+    Free(j);
+  }
+  return NULL;
+}
+
+/*******************************
+ * The writer's side of the queued work
+ *******************************/
+
+/* Append the len-byte object for key, head_len bytes of it the head, fresh until expires */
+static void disk_write(const char *key, unsigned long h, char *obj, size_t len, size_t head_len,
+                       time_t expires) {
+  size_t keylen = strlen(key), need = rec_size(keylen, len), off;
+  struct iovec iov[2];
+  disk_seg *s;
+  rec_hdr r;
+  int ok;
+
+  // claim the space, then write without the lock
+  pthread_mutex_lock(&disk_mutex);
+  if (segs[cur].used + need > DISK_SEGMENT && disk_reuse((cur + 1) % nsegs) < 0) {
+    pthread_mutex_unlock(&disk_mutex);
+    return;
+  }
+  s = &segs[cur];
+  off = s->base + s->used;
+  s->used += need;
+  s->refcnt++;  // not reused under us
+  r.magic = DISK_REC_MAGIC;
+  r.key_len = keylen;
+  r.gen = s->gen;
+  r.obj_len = len;
+  r.head_len = head_len;
+  r.expires = expires;
+  pthread_mutex_unlock(&disk_mutex);
+
+  // the bytes, then the header that makes them count
+  iov[0].iov_base = (char *)key;
+  iov[0].iov_len = keylen + 1;
+  iov[1].iov_base = obj;
+  iov[1].iov_len = len;
+  ok = pwritev(disk_fd, iov, 2, off + sizeof(r)) == (ssize_t)(keylen + 1 + len)
+    && pwrite(disk_fd, &r, sizeof(r), off) == sizeof(r);
+
+  pthread_mutex_lock(&disk_mutex);
+  s->refcnt--;
+  if (ok)
+    entry_add(s, key, h, off, len, head_len, expires);
+  pthread_mutex_unlock(&disk_mutex);
+}
+
+/* Revalidated: key is fresh until expires, in the index and the record */
+static void disk_write_expires(const char *key, unsigned long h, time_t expires) {
+  int64_t v = expires;
+  disk_entry *e;
+
+  pthread_mutex_lock(&disk_mutex);
+  if ((e = entry_lookup(key, h)) != NULL) {
+    e->expires = expires;
+    if (pwrite(disk_fd, &v, sizeof(v), e->off + offsetof(rec_hdr, expires)) != sizeof(v))
+      fprintf(stderr, "disk: can't refresh %s: %s\n", key, strerror(errno));
+  }
+  pthread_mutex_unlock(&disk_mutex);
+}
+
+static void disk_drop(const char *key, unsigned long h) {
+  disk_entry *e;
+
+  pthread_mutex_lock(&disk_mutex);
+  if ((e = entry_lookup(key, h)) != NULL)
+    entry_drop(e);
+  pthread_mutex_unlock(&disk_mutex);
+}
+
+/*******************************
+ * Segments and index, disk_mutex held
+ *******************************/
+
+/* Empty segment i and make it the one being filled; -1 if it is still in use */
+static int disk_reuse(int i) {
+  disk_seg *s = &segs[i];
+  seg_hdr sh;
+
+  if (s->refcnt > 0)
+    return -1;
+  while (s->entries)
+    entry_drop(s->entries);
+
+  s->gen = ++disk_gen;
+  s->used = sizeof(seg_hdr);
+  sh.magic = DISK_SEG_MAGIC;
+  sh.pad = 0;
+  sh.gen = s->gen;
+  if (pwrite(disk_fd, &sh, sizeof(sh), s->base) != sizeof(sh))
+    return -1;
+  cur = i;
+  return 0;
+}
+
+static void entry_add(disk_seg *s, const char *key, unsigned long h, size_t off,
+                      size_t obj_len, size_t head_len, time_t expires) {
+  disk_entry *e, **bucket = &buckets[h & (nbuckets - 1)];
+
+  if ((e = entry_lookup(key, h)) != NULL)
+    entry_drop(e);
+
+  e = Malloc(sizeof(disk_entry));
+  e->key = strdup(key);
+  e->hash = h;
+  e->off = off;
+  e->obj_len = obj_len;
+  e->head_len = head_len;
+  e->expires = expires;
+  e->seg = s;
+  e->hnext = *bucket;
+  *bucket = e;
+  e->sprev = NULL;
+  if ((e->snext = s->entries) != NULL)
+    e->snext->sprev = e;
+  s->entries = e;
+}
+
+static disk_entry *entry_lookup(const char *key, unsigned long h) {
+  disk_entry *e;
+
+  for (e = buckets[h & (nbuckets - 1)]; e; e = e->hnext) {
+    if (e->hash == h && strcmp(e->key, key) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+static void entry_drop(disk_entry *e) {
+  disk_entry **pp = &buckets[e->hash & (nbuckets - 1)];
+
+  while (*pp != e)
+    pp = &(*pp)->hnext;
+  *pp = e->hnext;
+  if (e->sprev)
+    e->sprev->snext = e->snext;
+  else
+    e->seg->entries = e->snext;
+  if (e->snext)
+    e->snext->sprev = e->sprev;
+  Free(e->key);
+  Free(e);
+}
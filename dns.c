@@ -0,0 +1,228 @@
+/*
+ * dns.c - resolver cache for end server connects
+ *
+ * getaddrinfo() results are kept per (host, port) for config.dns_ttl
+ * seconds, so only the first miss on a host in that time waits for name
+ * resolution.  Failed lookups are remembered too, for config.dns_neg_ttl
+ * seconds, so a bad hostname doesn't cost a lookup per request.
+ *
+ * An entry keeps the whole address list.  Each connect starts one address
+ * further along it than the last, so connections to a host with several
+ * addresses are spread across them, and one that is down is tried last
+ * as often as first.
+ *
+ * Entries are reference counted like cache blocks: a lookup hands out a
+ * reference, and an entry replaced after it expires is freed once the
+ * last connect using it is done with it.
+ *
+ * The event loops can't wait for getaddrinfo(): they take cache hits with
+ * dns_cached() and hand misses to DNS_RESOLVERS resolver threads with
+ * dns_lookup_async(), which call back with the entry when it is in.
+ */
+#include "proxy.h"
+
+#define DNS_BUCKETS 256
+
+/* A miss waiting for a resolver thread */
+typedef struct dns_job {
+  char *hostname;
+  int port;
+  void (*done)(void *arg, dns_entry *e);
+  void *arg;
+  struct dns_job *next;
+} dns_job;
+
+static dns_entry *dns_table[DNS_BUCKETS];
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long dns_hits, dns_misses, dns_neg_hits;
+
+static dns_job *job_head, *job_tail;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t resolvers_once = PTHREAD_ONCE_INIT;
+
+static dns_entry *dns_resolve(const char *key, char *hostname, int port);
+static void *resolver_thread(void *vargp);
+
+/*
+ * dns_cached - the cached addresses of hostname:port, or NULL if they
+ *     aren't cached (or have expired).  The caller must dns_put() the entry.
+ */
+dns_entry *dns_cached(char *hostname, int port) {
+  char key[MAXLINE];
+  time_t now = time(NULL);
+  dns_entry *e;
+  unsigned i;
+
+  snprintf(key, sizeof(key), "%s:%d", hostname, port);
+  i = url_hash(key) % DNS_BUCKETS;
+
+  pthread_mutex_lock(&dns_mutex);
+  for (e = dns_table[i]; e; e = e->next) {
+    if (strcmp(e->key, key) == 0 && e->expires > now) {
+      __atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&dns_mutex);
+      __atomic_add_fetch(e->naddrs ? &dns_hits : &dns_neg_hits, 1, __ATOMIC_RELAXED);
+      return e;
+    }
+  }
+  pthread_mutex_unlock(&dns_mutex);
+  return NULL;
+}
+
+/*
+ * dns_lookup - the addresses of hostname:port, from the cache or a fresh
+ *     getaddrinfo().  Never NULL; naddrs is 0 if the name doesn't resolve.
+ *     The caller must dns_put() the entry.
+ */
+dns_entry *dns_lookup(char *hostname, int port) {
+  char key[MAXLINE];
+  dns_entry *e, **pp, *old, *dead = NULL;
+  time_t now = time(NULL);
+  unsigned i;
+
+  if ((e = dns_cached(hostname, port)) != NULL)
+    return e;
+  snprintf(key, sizeof(key), "%s:%d", hostname, port);
+  i = url_hash(key) % DNS_BUCKETS;
+
+  // resolve without the lock; concurrent misses on one host each resolve it
+  __atomic_add_fetch(&dns_misses, 1, __ATOMIC_RELAXED);
+  e = dns_resolve(key, hostname, port);
+
+  // replace the old entry for key, and drop any others that have expired
+  pthread_mutex_lock(&dns_mutex);
+  for (pp = &dns_table[i]; (old = *pp) != NULL; ) {
+    if (strcmp(old->key, key) == 0 || old->expires <= now) {
+      *pp = old->next;
+      old->next = dead;
+      dead = old;
+    } else {
+      pp = &old->next;
+    }
+  }
+  e->next = dns_table[i];
+  dns_table[i] = e;
+  pthread_mutex_unlock(&dns_mutex);
+
+  while ((old = dead) != NULL) {
+    dead = old->next;
+    dns_put(old);  // the table's reference
+  }
+  return e;
+}
+
+static dns_entry *dns_resolve(const char *key, char *hostname, int port) {
+  struct addrinfo hints, *p;
+  char portStr[16];
+  dns_entry *e;
+  int n = 0;
+
+  e = Calloc(1, sizeof(dns_entry));
+  e->key = strdup(key);
+  e->refcnt = 2;  // the table's and the caller's
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;  // same as open_clientfd()
+  sprintf(portStr, "%d", port);
+  if ((e->err = getaddrinfo(hostname, portStr, &hints, &e->list)) != 0) {
+    fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, portStr, gai_strerror(e->err));
+    e->list = NULL;
+    e->expires = time(NULL) + config.dns_neg_ttl;
+    return e;
+  }
+
+  for (p = e->list; p; p = p->ai_next)
+    n++;
+  e->addrv = Malloc(n * sizeof(struct addrinfo *));
+  for (p = e->list; p; p = p->ai_next)
+    e->addrv[e->naddrs++] = p;
+  e->expires = time(NULL) + config.dns_ttl;
+  return e;
+}
+
+void dns_put(dns_entry *e) {
+  if (__atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  if (e->list)
+    freeaddrinfo(e->list);
+  if (e->addrv)
+    Free(e->addrv);
+  Free(e->key);
+  Free(e);
+}
+
+/* Where the next connect to e should start in its address list */
+unsigned dns_rotate(dns_entry *e) {
+  return __atomic_fetch_add(&e->rotor, 1, __ATOMIC_RELAXED);
+}
+
+/* The i-th address to try for a connect that started at start */
+struct addrinfo *dns_addr(dns_entry *e, unsigned start, int i) {
+  return e->addrv[(start + i) % e->naddrs];
+}
+
+/* Lookups answered from the cache (hits, neg_hits: from a failed lookup) and not */
+void dns_stats(unsigned long *hits, unsigned long *neg_hits, unsigned long *misses) {
+  *hits = __atomic_load_n(&dns_hits, __ATOMIC_RELAXED);
+  *neg_hits = __atomic_load_n(&dns_neg_hits, __ATOMIC_RELAXED);
+  *misses = __atomic_load_n(&dns_misses, __ATOMIC_RELAXED);
+}
+
+/*******************************
+ * Resolver threads, for the event loops
+ *******************************/
+
+static void resolvers_init() {
+  pthread_t tid;
+  int i;
+
+  for (i = 0; i < DNS_RESOLVERS; i++)
+    Pthread_create(&tid, NULL, resolver_thread, NULL);
+}
+
+/*
+ * dns_lookup_async - look hostname:port up on a resolver thread, which
+ *     then calls done(arg, e) with what dns_lookup() would have returned.
+ *     done runs on that thread.
+ */
+void dns_lookup_async(char *hostname, int port, void (*done)(void *arg, dns_entry *e), void *arg) {
+  dns_job *j = Malloc(sizeof(dns_job));
+
+  pthread_once(&resolvers_once, resolvers_init);
+  j->hostname = strdup(hostname);
+  j->port = port;
+  j->done = done;
+  j->arg = arg;
+  j->next = NULL;
+  pthread_mutex_lock(&job_mutex);
+  if (job_tail)
+    job_tail->next = j;
+  else
+    job_head = j;
+  job_tail = j;
+  pthread_cond_signal(&job_cond);
+  pthread_mutex_unlock(&job_mutex);
+}
+
+static void *resolver_thread(void *vargp) {
+  dns_job *j;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    pthread_mutex_lock(&job_mutex);
+    while (job_head == NULL)
+      pthread_cond_wait(&job_cond, &job_mutex);
+    j = job_head;
+    if ((job_head = j->next) == NULL)
+      job_tail = NULL;
+    pthread_mutex_unlock(&job_mutex);
+
+    j->done(j->arg, dns_lookup(j->hostname, j->port));
+    Free(j->hostname);
+    Free(j);
+  }
+  return NULL;
+}
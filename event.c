@@ -0,0 +1,1131 @@
+/*
+ * event.c - non-blocking epoll engine for the proxy (-m epoll)
+ *
+ * A fixed number of event-loop threads share the listening socket.  Each
+ * loop owns the connections it accepts and drives them through the same
+ * phases as doit(), one state per blocking call there:
+ *
+ *   ST_READ_REQ  read the request line and headers from the client
+ *   ST_RESOLVE   wait for a resolver thread to look the end server up,
+ *                when dns_cached() doesn't have it
+ *   ST_CONNECT   non-blocking connects to the end server's addresses,
+ *                raced CONNECT_STAGGER ms apart (upstream_connect() does
+ *                the same for doit()); skipped when an idle pooled
+ *                connection to it is available
+ *   ST_SEND_REQ  write the rebuilt request to the end server
+ *   ST_RELAY     read the response and write it on to the client,
+ *                keeping a copy for the cache; once a body is known to
+ *                be too big to cache it is spliced through a pipe instead
+ *   ST_WRITE     write a cached object to the client
+ *
+ * Once the response is complete the end server connection goes back to
+ * the pool (upstream.c) while the rest is still being written out.  When
+ * the client keeps its connection, it then goes back to ST_READ_REQ with
+ * any pipelined bytes already read; the client is not read while a
+ * response is in flight, so responses stay in request order.
+ *
+ * Each connection has one timer, for whatever it is waiting on: the next
+ * request (config.client_idle), the rest of the request head
+ * (config.header_timeout), the connect, the end server's first byte and
+ * then each gap between its bytes, or the client taking our writes.
+ * Timers live in a hashed wheel per loop, so arming, moving and expiring
+ * one is constant time however many connections are open.  A bitmap of
+ * the slots that have timers tells epoll_wait() how long it may sleep
+ * without looking at the timers themselves.  A request that
+ * times out before anything was sent back gets a 408 or 504.
+ *
+ * When accept() runs out of descriptors the loop stops watching the
+ * listening socket for ACCEPT_BACKOFF ms: it is level-triggered, so
+ * otherwise the loop would spin on it until some connections close.
+ *
+ * A connection never moves between loops, so its state needs no locking.
+ * The one exception is a lookup's result, which a resolver thread puts on
+ * its loop's resolved list and signals through the loop's eventfd.
+ */
+#define _GNU_SOURCE  /* splice */
+#include "proxy.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define EV_MAXEVENTS 256
+
+#define WHEEL_SLOTS 512  /* power of two */
+#define WHEEL_TICK  16   /* ms per slot, so one turn of the wheel is about 8 s */
+#define WHEEL_WORDS (WHEEL_SLOTS / 64)
+
+enum {
+  ST_READ_REQ,
+  ST_RESOLVE,
+  ST_CONNECT,
+  ST_SEND_REQ,
+  ST_RELAY,
+  ST_WRITE,
+  ST_CLOSED
+};
+
+typedef struct conn conn;
+typedef struct ev_loop ev_loop;
+
+/* epoll_event.data.ptr points at one of these so we know which socket fired */
+typedef struct {
+  conn *c;             // NULL for the listening socket
+  int fd;
+  unsigned events;     // events currently registered, 0 if not in the epoll set
+} ev_ref;
+
+struct conn {
+  int state;
+  ev_ref client, server;
+
+  char req[MAXLINE];   // client request head, parsed in place, then any pipelined bytes
+  size_t req_len;
+  http_req q;          // the head in c->req, see req_feed()
+  char *url;           // cache key, NUL-terminated in c->req
+  int keepalive;       // client connection stays open after this response
+
+  struct iovec out[REQ_IOV];  // request for the end server, mostly pointing into c->req
+  int out_cnt;
+  size_t out_len, out_off;
+  char cond[MAXLINE];  // conditional headers when revalidating
+  char host_line[MAXLINE];  // Host for the end server if the client sent none
+  char hostname[MAXLINE];
+  int port;
+  upstream *up;        // end server connection once connected, c->server.fd is its fd
+
+  http_resp resp;
+  char head[MAXBUF + 64];  // response head for the client, see resp_stem()
+  size_t stem_len;     // non-zero once the head has been built
+  size_t head_len;     // head bytes still to be flushed
+  int chunked;         // body is chunked for the client
+  char pre[32];        // chunk size line ahead of buf
+  size_t pre_len;
+  char *post;          // chunk framing after buf
+  char buf[MAXBUF];    // response body bytes not yet written to the client
+  size_t buf_len;
+  size_t flush_off;    // bytes of head, pre, buf and post already written
+  int splicing;        // relaying the body through pipefd
+  int pipefd[2];       // made on first use, kept for the connection's life
+  size_t piped;        // bytes in the pipe not yet spliced to the client
+
+  cache_tee cachebuf;  // copy of the response for cache_uri()
+
+  cache_block *hit;    // cached object being served, referenced
+  size_t hit_off;
+  cache_block *stale;  // cached object c->out revalidates, referenced
+
+  dns_entry *dns;      // end server addresses while connecting
+  int resolving;       // a resolver thread has it: not freed until resolve_done() hands it back
+  dns_entry *resolved; // what the resolver thread found, for loop_resolved()
+  conn *next_resolved;
+  unsigned addr_start; // this connect's place in the rotation, see dns_rotate()
+  int next_addr;       // index of the next address to try
+  ev_ref att[CONNECT_MAX_TRY];  // connects in flight, fd -1 once failed
+  int natt;
+  long long connect_deadline;  // ms: when to give up
+
+  access_rec rec;      // the request being served, for the access log and stats_time()
+  long long t_phase;   // us: current phase started
+
+  long long expires;   // ms: when the timer goes off, 0 if it isn't set
+  conn *tprev, *tnext; // same wheel slot
+  conn *next_ready;
+  conn *next_dead;
+  ev_loop *loop;       // the loop that owns it
+};
+
+struct ev_loop {
+  int epfd;
+  ev_ref listen;
+  ev_ref wake;         // eventfd: resolver threads have put connections on resolved
+  pthread_mutex_t resolved_mutex;
+  conn *resolved;      // lookups done, waiting for this loop to carry on with them
+  long long accept_resume;  // ms: when to watch the listening socket again, 0 if watched
+  conn *wheel[WHEEL_SLOTS];  // timers by expiry tick, modulo WHEEL_SLOTS
+  uint64_t busy[WHEEL_WORDS];  // a bit per slot of wheel: set if it has any
+  long long tick;      // ticks (WHEEL_TICK ms) up to this one have been run
+  conn *ready;         // have a pipelined request head waiting in c->req
+  conn *dead;          // closed during this batch of events, freed after it
+};
+
+static void *loop_thread(void *vargp);
+static void loop_run(ev_loop *l);
+static void loop_accept(ev_loop *l);
+static void loop_resolved(ev_loop *l);
+static int loop_timeout(ev_loop *l);
+static void timer_set(ev_loop *l, conn *c, long long when);
+static void timer_clear(ev_loop *l, conn *c);
+static void timer_run(ev_loop *l);
+static void conn_timeout(ev_loop *l, conn *c);
+static void wait_request(ev_loop *l, conn *c);
+static int req_ready(ev_loop *l, conn *c);
+static void request_done(ev_loop *l, conn *c);
+static void ev_watch(ev_loop *l, ev_ref *r, unsigned events);
+static void conn_close(ev_loop *l, conn *c);
+static void client_event(ev_loop *l, conn *c);
+static void server_event(ev_loop *l, conn *c, ev_ref *r);
+static void connect_next(ev_loop *l, conn *c);
+static void connect_event(ev_loop *l, conn *c, ev_ref *r);
+static void connect_won(ev_loop *l, conn *c, int fd);
+static void connect_end(ev_loop *l, conn *c);
+static void start_request(ev_loop *l, conn *c);
+static void start_resolve(ev_loop *l, conn *c);
+static void resolve_done(void *arg, dns_entry *e);
+static void resolved(ev_loop *l, conn *c);
+static void start_connect(ev_loop *l, conn *c);
+static void server_connected(ev_loop *l, conn *c);
+static void server_retry(ev_loop *l, conn *c);
+static void server_failed(ev_loop *l, conn *c);
+static void server_done(ev_loop *l, conn *c, int reusable);
+static void server_send(ev_loop *l, conn *c);
+static void server_read(ev_loop *l, conn *c);
+static void server_splice(ev_loop *l, conn *c);
+static void client_flush(ev_loop *l, conn *c);
+static void client_write_obj(ev_loop *l, conn *c);
+
+static int set_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Start nloops event loops on listenfd; the calling thread runs the last one */
+void event_run(int listenfd, int nloops) {
+  pthread_t tid;
+  ev_loop *l;
+  int i;
+
+  if (set_nonblock(listenfd) < 0)
+    unix_error("event_run: fcntl error");
+
+  for (i = 0; i < nloops; i++) {
+    l = Calloc(1, sizeof(ev_loop));
+    if ((l->epfd = epoll_create1(0)) < 0)
+      unix_error("event_run: epoll_create1 error");
+    l->listen.fd = listenfd;
+    l->tick = now_ms() / WHEEL_TICK;
+    // EPOLLEXCLUSIVE: wake one loop per incoming connection, not all of them
+    ev_watch(l, &l->listen, EPOLLIN | EPOLLEXCLUSIVE);
+    if ((l->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+      unix_error("event_run: eventfd error");
+    pthread_mutex_init(&l->resolved_mutex, NULL);
+    ev_watch(l, &l->wake, EPOLLIN);
+
+    if (i < nloops - 1)
+      Pthread_create(&tid, NULL, loop_thread, l);
+    else
+      loop_run(l);
+  }
+}
+
+static void *loop_thread(void *vargp) {
+  Pthread_detach(pthread_self());
+  loop_run((ev_loop *)vargp);
+  return NULL;
+}
+
+static void loop_run(ev_loop *l) {
+  struct epoll_event events[EV_MAXEVENTS];
+  int i, n, woken;
+  uint64_t count;
+  ev_ref *r;
+  conn *c;
+
+  while (1) {
+    if ((n = epoll_wait(l->epfd, events, EV_MAXEVENTS, loop_timeout(l))) < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("epoll_wait error");
+    }
+
+    woken = 0;
+    for (i = 0; i < n; i++) {
+      r = events[i].data.ptr;
+      if (r == &l->wake) {
+        if (read(l->wake.fd, &count, sizeof(count)) > 0)
+          woken = 1;
+        continue;
+      }
+      if (r->c == NULL) {
+        loop_accept(l);
+        continue;
+      }
+      c = r->c;
+      if (c->state == ST_CLOSED)  // closed earlier in this batch
+        continue;
+      if (r == &c->client)
+        client_event(l, c);
+      else
+        server_event(l, c, r);
+    }
+    timer_run(l);
+    if (l->accept_resume && now_ms() >= l->accept_resume) {
+      l->accept_resume = 0;
+      ev_watch(l, &l->listen, EPOLLIN | EPOLLEXCLUSIVE);
+    }
+    while ((c = l->ready) != NULL) {
+      l->ready = c->next_ready;
+      if (c->state == ST_READ_REQ)
+        start_request(l, c);
+    }
+
+    while ((c = l->dead) != NULL) {
+      l->dead = c->next_dead;
+      if (!c->resolving)  // else loop_resolved() frees it
+        Free(c);
+    }
+    // after the dead list, so a closed connection on resolved is on neither
+    if (woken)
+      loop_resolved(l);
+  }
+}
+
+/* Carry on with the connections whose lookups have come back */
+static void loop_resolved(ev_loop *l) {
+  conn *c, *next;
+
+  pthread_mutex_lock(&l->resolved_mutex);
+  c = l->resolved;
+  l->resolved = NULL;
+  pthread_mutex_unlock(&l->resolved_mutex);
+
+  for (; c; c = next) {
+    next = c->next_resolved;
+    c->resolving = 0;
+    if (c->state == ST_CLOSED) {  // timed out waiting
+      dns_put(c->resolved);
+      Free(c);
+      continue;
+    }
+    c->dns = c->resolved;
+    resolved(l, c);
+  }
+}
+
+/*
+ * Take up to ACCEPT_BATCH connections off the accept queue, already
+ * non-blocking; another loop may win the race, hence EAGAIN.  Whatever is
+ * left wakes a loop again, so one loop can't take a whole burst.  Out of
+ * descriptors, stop watching the listening socket for ACCEPT_BACKOFF ms.
+ */
+static void loop_accept(ev_loop *l) {
+  int connfd, n;
+  conn *c;
+
+  for (n = 0; n < ACCEPT_BATCH; n++) {
+    if ((connfd = accept4(l->listen.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+      if (errno == ECONNABORTED || errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      fprintf(stderr, "accept error: %s\n", strerror(errno));
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        // EPOLLEXCLUSIVE can't be modified, only removed and added back
+        ev_watch(l, &l->listen, 0);
+        l->accept_resume = now_ms() + ACCEPT_BACKOFF;
+      }
+      return;
+    }
+
+    c = Calloc(1, sizeof(conn));
+    c->loop = l;
+    c->state = ST_READ_REQ;
+    c->client.c = c->server.c = c;
+    c->client.fd = connfd;
+    c->server.fd = -1;
+    c->post = "";
+    c->pipefd[0] = c->pipefd[1] = -1;
+    req_init(&c->q);
+    stats_add(STAT_CONNS_OPENED, 1);
+    wait_request(l, c);
+  }
+}
+
+/*
+ * How long epoll_wait() may sleep: to the end of the tick of the next
+ * slot that has a timer, found in l->busy, or forever if none is set.  A
+ * timer can so go off up to WHEEL_TICK ms late, and a slot holding only
+ * timers for a later turn costs a wakeup that fires nothing.  No later
+ * than l->accept_resume either.
+ */
+static int loop_timeout(ev_loop *l) {
+  long long now = now_ms(), first = -1;
+  unsigned start = l->tick & (WHEEL_SLOTS - 1), w = start / 64, k, slot;
+  uint64_t bits = l->busy[w] & (~0ULL << (start % 64));
+
+  // one word after another from the current slot, round to its word again
+  for (k = 0; k <= WHEEL_WORDS; k++) {
+    if (bits) {
+      slot = w * 64 + __builtin_ctzll(bits);
+      first = (l->tick + ((slot - start) & (WHEEL_SLOTS - 1)) + 1) * WHEEL_TICK;
+      break;
+    }
+    w = (w + 1) % WHEEL_WORDS;
+    bits = l->busy[w];
+  }
+  if (l->accept_resume && (first < 0 || l->accept_resume < first))
+    first = l->accept_resume;
+  if (first < 0)
+    return -1;
+  return first > now ? first - now : 0;
+}
+
+/*******************************
+ * Timer wheel
+ *******************************/
+
+/* Set c's timer to go off at when (ms), replacing the one it had */
+static void timer_set(ev_loop *l, conn *c, long long when) {
+  unsigned i = (when / WHEEL_TICK) & (WHEEL_SLOTS - 1);
+
+  timer_clear(l, c);
+  c->expires = when;
+  c->tprev = NULL;
+  if ((c->tnext = l->wheel[i]) != NULL)
+    c->tnext->tprev = c;
+  l->wheel[i] = c;
+  l->busy[i / 64] |= 1ULL << (i % 64);
+}
+
+static void timer_clear(ev_loop *l, conn *c) {
+  unsigned i = (c->expires / WHEEL_TICK) & (WHEEL_SLOTS - 1);
+
+  if (c->expires == 0)
+    return;
+  if (c->tprev)
+    c->tprev->tnext = c->tnext;
+  else if ((l->wheel[i] = c->tnext) == NULL)
+    l->busy[i / 64] &= ~(1ULL << (i % 64));
+  if (c->tnext)
+    c->tnext->tprev = c->tprev;
+  c->expires = 0;
+}
+
+/* Fire the timers that are due: the slots from the last run's tick to now */
+static void timer_run(ev_loop *l) {
+  long long now = now_ms(), last = now / WHEEL_TICK, t = l->tick;
+  conn *c, *next;
+
+  if (last - t >= WHEEL_SLOTS)  // away a whole turn: every slot once is enough
+    t = last - WHEEL_SLOTS + 1;
+  for (; t <= last; t++) {
+    for (c = l->wheel[t & (WHEEL_SLOTS - 1)]; c; c = next) {
+      next = c->tnext;
+      if (c->expires <= now) {  // else due on a later turn
+        timer_clear(l, c);
+        conn_timeout(l, c);
+      }
+    }
+  }
+  l->tick = last;  // the rest of this tick's timers are seen next time
+}
+
+/* c's timer went off: what that means depends on what it was waiting for */
+static void conn_timeout(ev_loop *l, conn *c) {
+  switch (c->state) {
+  case ST_READ_REQ:
+    if (c->req_len > c->q.start) {  // stalled part way through a request head
+      clienterror(c->client.fd, "", "408", "Request Timeout", "The request headers took too long");
+      c->rec.status = 408;
+    }
+    conn_close(l, c);
+    return;
+  case ST_CONNECT:
+    if (now_ms() < c->connect_deadline) {  // time to race the next address
+      connect_next(l, c);
+      return;
+    }
+    upstream_failed(c->hostname, c->port, 504);
+    break;
+  case ST_RESOLVE:  // the name server is slow: the lookup finishes without us
+    break;
+  case ST_SEND_REQ:
+    break;
+  case ST_RELAY:
+    if (c->stem_len == 0)  // nothing sent to the client yet
+      break;
+    conn_close(l, c);  // mid-response: all we can do is cut it off
+    return;
+  case ST_WRITE:
+    conn_close(l, c);
+    return;
+  }
+  clienterror(c->client.fd, c->hostname, "504", "Gateway Timeout", "The end server did not answer in time");
+  c->rec.status = 504;
+  conn_close(l, c);
+}
+
+/* Wait for a request: quiet for up to config.client_idle, then config.header_timeout once it starts */
+static void wait_request(ev_loop *l, conn *c) {
+  int secs = (c->req_len <= c->q.start && config.client_idle > 0) ? config.client_idle : config.header_timeout;
+
+  timer_set(l, c, now_ms() + secs * 1000LL);
+  ev_watch(l, &c->client, EPOLLIN);
+}
+
+/* Make r's registered interest set equal to events (0 removes it) */
+static void ev_watch(ev_loop *l, ev_ref *r, unsigned events) {
+  struct epoll_event ev;
+  int op;
+
+  if (r->events == events)
+    return;
+  if (events == 0)
+    op = EPOLL_CTL_DEL;
+  else if (r->events == 0)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+
+  ev.events = events;
+  ev.data.ptr = r;
+  if (epoll_ctl(l->epfd, op, r->fd, &ev) < 0)
+    unix_error("epoll_ctl error");
+  r->events = events;
+}
+
+static void conn_close(ev_loop *l, conn *c) {
+  log_request(&c->rec);  // if one was cut short
+  // close() also drops the descriptors from the epoll set
+  if (c->client.fd >= 0)
+    close(c->client.fd);
+  if (c->up)
+    upstream_put(c->up, 0);  // closes c->server.fd
+  else if (c->server.fd >= 0)
+    close(c->server.fd);
+  if (c->state == ST_CONNECT)
+    connect_end(l, c);
+  timer_clear(l, c);
+  if (c->dns)
+    dns_put(c->dns);
+  tee_free(&c->cachebuf);
+  if (c->hit)
+    cache_put(c->hit);
+  if (c->stale)
+    cache_put(c->stale);
+  if (c->pipefd[0] >= 0) {
+    close(c->pipefd[0]);
+    close(c->pipefd[1]);
+  }
+
+  stats_add(STAT_CONNS_CLOSED, 1);
+  c->state = ST_CLOSED;
+  c->next_dead = l->dead;
+  l->dead = c;
+}
+
+static void client_event(ev_loop *l, conn *c) {
+  ssize_t n;
+
+  switch (c->state) {
+  case ST_READ_REQ:
+    n = read(c->client.fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    if (n <= 0) {
+      conn_close(l, c);
+      return;
+    }
+    c->req_len += n;
+    c->req[c->req_len] = '\0';
+    if (req_ready(l, c))
+      start_request(l, c);
+    return;
+  case ST_RELAY:
+    client_flush(l, c);
+    return;
+  case ST_WRITE:
+    client_write_obj(l, c);
+    return;
+  }
+}
+
+static void server_event(ev_loop *l, conn *c, ev_ref *r) {
+  switch (c->state) {
+  case ST_CONNECT:
+    if (r != &c->server && r->fd >= 0)  // one of the raced connects
+      connect_event(l, c, r);
+    return;
+  case ST_SEND_REQ:
+    server_send(l, c);
+    return;
+  case ST_RELAY:
+    if (c->up)  // not already handed back earlier in this batch
+      server_read(l, c);
+    return;
+  }
+}
+
+/*
+ * Is a whole request head in c->req?  Only the lines that came in since
+ * the last call are scanned.  A head that doesn't parse or doesn't fit is
+ * answered here and the connection closed.
+ */
+static int req_ready(ev_loop *l, conn *c) {
+  int rc = req_feed(&c->q, c->req, c->req_len);
+
+  if (c->rec.start == 0 && c->req_len > c->q.start) {
+    // a request has started: the idle timer becomes the head's deadline
+    log_start(&c->rec);
+    stats_add(STAT_REQUESTS, 1);
+    if (rc == 0)
+      timer_set(l, c, now_ms() + config.header_timeout * 1000LL);
+  }
+  if (rc == 1)
+    return 1;
+  if (rc < 0) {
+    clienterror(c->client.fd, "", "400", "Bad Request", "The proxy could not parse the request");
+    c->rec.status = 400;
+    conn_close(l, c);
+  } else if (c->req_len == sizeof(c->req) - 1) {
+    clienterror(c->client.fd, "", "431", "Request Header Fields Too Large", "The request head is too long");
+    c->rec.status = 431;
+    conn_close(l, c);
+  }
+  return 0;
+}
+
+/* The whole request head is parsed in c->req: look it up, or send it on to the end server */
+static void start_request(ev_loop *l, conn *c) {
+  char *method = c->req + c->q.method.off;  // NUL-terminated in place by req_feed()
+  size_t n = 0;
+  long long t;
+  int fresh, status, i;
+
+  ev_watch(l, &c->client, 0);  // pipelined requests wait in the socket until this one is answered
+  c->url = c->req + c->q.uri.off;
+  log_url(&c->rec, method, c->url);
+  if (strcasecmp(method, "GET")) {
+    conn_close(l, c);  // not implemented; logged with no status
+    return;
+  }
+  req_host(&c->q, c->req, c->hostname);
+  c->port = c->q.port;
+  c->keepalive = c->q.keepalive && config.client_idle > 0;
+  stats_time(&c->rec, PH_HEADER, now_us() - c->rec.start);
+
+  t = now_us();
+  c->hit = cache_find(c->url);
+  stats_time(&c->rec, PH_LOOKUP, now_us() - t);
+  if (c->hit != NULL) {
+    if (!(fresh = cache_fresh(c->hit, 0))) {
+      // stale, but within its grace: served now and refreshed in the background
+      cache_stem(c->hit, c->head);
+      if ((fresh = cache_fresh(c->hit, stale_grace(c->head))))
+        refresh_start(c->url, c->hit);
+      c->rec.outcome = LOG_STALE;
+    } else
+      c->rec.outcome = LOG_HIT;
+    if (fresh) {
+      // written straight from the block; our reference keeps it alive
+      stats_add(STAT_HITS, 1);
+      c->rec.status = head_status(c->hit->cache_obj);
+      c->state = ST_WRITE;
+      client_write_obj(l, c);
+      return;
+    }
+    // too stale: revalidate it if its head has validators, else fetch it again
+    if ((n = cond_headers(c->head, c->cond)) > 0)
+      c->stale = c->hit;
+    else
+      cache_put(c->hit);
+    c->hit = NULL;
+  }
+
+  stats_add(STAT_MISSES, 1);
+  c->rec.outcome = LOG_MISS;
+  // the end server failed to connect a moment ago: don't wait on it again
+  if ((status = upstream_down(c->hostname, c->port)) != 0) {
+    gateway_error(c->client.fd, c->hostname, status);
+    c->rec.status = status;
+    c->rec.outcome = LOG_NEGATIVE;
+    conn_close(l, c);
+    return;
+  }
+
+  // a response to a request with credentials is for that client alone
+  if (c->q.auth)
+    tee_drop(&c->cachebuf);
+
+  // straight out of the client's head, plus the conditional headers if revalidating
+  c->out_cnt = request_iov(&c->q, c->req, c->out, c->host_line, c->cond, c->stale ? n : 0);
+  for (c->out_len = 0, i = 0; i < c->out_cnt; i++)
+    c->out_len += c->out[i].iov_len;
+  resp_init(&c->resp);
+
+  // an idle pooled connection saves the lookup and the connect
+  c->t_phase = now_us();
+  if ((c->up = upstream_idle(c->hostname, c->port)) != NULL && set_nonblock(c->up->fd) == 0) {
+    stats_time(&c->rec, PH_CONNECT, now_us() - c->t_phase);
+    c->server.fd = c->up->fd;
+    c->state = ST_SEND_REQ;
+    timer_set(l, c, now_ms() + config.first_byte_timeout * 1000LL);
+    server_send(l, c);
+    return;
+  }
+  if (c->up) {
+    upstream_put(c->up, 0);
+    c->up = NULL;
+  }
+  start_resolve(l, c);
+}
+
+static void start_resolve(ev_loop *l, conn *c) {
+  c->t_phase = now_us();
+  // a name that isn't cached is looked up on a resolver thread, never here
+  if ((c->dns = dns_cached(c->hostname, c->port)) == NULL) {
+    c->state = ST_RESOLVE;
+    c->resolving = 1;
+    timer_set(l, c, now_ms() + config.connect_timeout);
+    dns_lookup_async(c->hostname, c->port, resolve_done, c);
+    return;
+  }
+  resolved(l, c);
+}
+
+/* On a resolver thread: queue c back to its loop with e */
+static void resolve_done(void *arg, dns_entry *e) {
+  conn *c = arg;
+  ev_loop *l = c->loop;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&l->resolved_mutex);
+  c->resolved = e;
+  c->next_resolved = l->resolved;
+  l->resolved = c;
+  pthread_mutex_unlock(&l->resolved_mutex);
+  if (write(l->wake.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    unix_error("resolve_done: eventfd write error");
+}
+
+/* c->dns has the end server's addresses, or none */
+static void resolved(ev_loop *l, conn *c) {
+  if (c->dns->naddrs == 0) {
+    server_failed(l, c);
+    return;
+  }
+  c->addr_start = dns_rotate(c->dns);
+  c->next_addr = 0;
+  start_connect(l, c);
+}
+
+/* Start racing connects to the end server's addresses */
+static void start_connect(ev_loop *l, conn *c) {
+  c->state = ST_CONNECT;
+  c->natt = 0;
+  c->connect_deadline = now_ms() + config.connect_timeout;
+  connect_next(l, c);
+}
+
+/*
+ * Start a connect to the next address that gets as far as EINPROGRESS, and
+ * set the timer for racing the one after it
+ */
+static void connect_next(ev_loop *l, conn *c) {
+  struct addrinfo *p;
+  ev_ref *r;
+  long long next_try;
+  int i, fd;
+
+  while (c->next_addr < c->dns->naddrs && c->natt < CONNECT_MAX_TRY) {
+    p = dns_addr(c->dns, c->addr_start, c->next_addr++);
+    if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol)) < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+      connect_won(l, c, fd);
+      return;
+    }
+    if (errno == EINPROGRESS) {
+      r = &c->att[c->natt++];
+      r->c = c;
+      r->fd = fd;
+      r->events = 0;
+      ev_watch(l, r, EPOLLOUT);
+      next_try = now_ms() + CONNECT_STAGGER;
+      timer_set(l, c, next_try < c->connect_deadline ? next_try : c->connect_deadline);
+      return;
+    }
+    close(fd);
+  }
+
+  timer_set(l, c, c->connect_deadline);  // nothing left to race
+  for (i = 0; i < c->natt; i++) {
+    if (c->att[i].fd >= 0)
+      return;  // still waiting on one
+  }
+  server_failed(l, c);
+}
+
+/* The end server can't be reached or took no request: 502, and remember it is down */
+static void server_failed(ev_loop *l, conn *c) {
+  upstream_failed(c->hostname, c->port, 502);
+  gateway_error(c->client.fd, c->hostname, 502);
+  c->rec.status = 502;
+  conn_close(l, c);
+}
+
+/* One of the raced connects finished */
+static void connect_event(ev_loop *l, conn *c, ev_ref *r) {
+  int i, fd, err = 0;
+  socklen_t len = sizeof(err);
+
+  getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+  ev_watch(l, r, 0);
+  if (err == 0) {
+    fd = r->fd;
+    r->fd = -1;  // so connect_end() leaves it open
+    connect_won(l, c, fd);
+    return;
+  }
+  close(r->fd);
+  r->fd = -1;
+
+  // no need to wait out the stagger if nothing else is in flight
+  for (i = 0; i < c->natt; i++) {
+    if (c->att[i].fd >= 0)
+      return;
+  }
+  connect_next(l, c);
+}
+
+static void connect_won(ev_loop *l, conn *c, int fd) {
+  connect_end(l, c);
+  c->server.fd = fd;
+  server_connected(l, c);
+}
+
+/* Leaving ST_CONNECT: close the connects still in flight */
+static void connect_end(ev_loop *l, conn *c) {
+  int i;
+
+  for (i = 0; i < c->natt; i++) {
+    if (c->att[i].fd >= 0) {
+      ev_watch(l, &c->att[i], 0);
+      close(c->att[i].fd);
+      c->att[i].fd = -1;
+    }
+  }
+  c->natt = 0;
+}
+
+static void server_connected(ev_loop *l, conn *c) {
+  stats_time(&c->rec, PH_CONNECT, now_us() - c->t_phase);
+  dns_put(c->dns);
+  c->dns = NULL;
+  c->up = upstream_new(c->server.fd, c->hostname, c->port);
+  c->state = ST_SEND_REQ;
+  timer_set(l, c, now_ms() + config.first_byte_timeout * 1000LL);
+  server_send(l, c);
+}
+
+/*
+ * The end server closed a pooled connection before answering on it: start
+ * over on a new connection.  A new one is never retried, so this happens
+ * at most once per request.
+ */
+static void server_retry(ev_loop *l, conn *c) {
+  ev_watch(l, &c->server, 0);
+  upstream_put(c->up, 0);
+  c->up = NULL;
+  c->server.fd = -1;
+  c->server.events = 0;
+  c->out_off = 0;
+  resp_init(&c->resp);
+  start_resolve(l, c);
+}
+
+/* The response is complete: hand the end server connection back and cache the copy */
+static void server_done(ev_loop *l, conn *c, int reusable) {
+  ev_watch(l, &c->server, 0);
+  upstream_put(c->up, reusable);
+  c->up = NULL;
+  c->server.fd = -1;
+
+  // store it, same rule as doit()
+  if (c->cachebuf.buf != NULL)
+    cache_response(c->url, &c->cachebuf, &c->resp, c->stem_len);
+  tee_free(&c->cachebuf);
+}
+
+static void server_send(ev_loop *l, conn *c) {
+  ssize_t n;
+
+  while (c->out_off < c->out_len) {
+    n = writev_at(c->server.fd, c->out, c->out_cnt, c->out_off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        ev_watch(l, &c->server, EPOLLOUT);
+        return;
+      }
+      if (c->up->reused)
+        server_retry(l, c);
+      else
+        server_failed(l, c);
+      return;
+    }
+    c->out_off += n;
+  }
+
+  c->state = ST_RELAY;
+  c->t_phase = now_us();
+  ev_watch(l, &c->server, EPOLLIN);
+}
+
+static void server_read(ev_loop *l, conn *c) {
+  ssize_t n, used;
+  size_t body;
+
+  if (c->splicing) {
+    server_splice(l, c);
+    return;
+  }
+  n = read(c->server.fd, c->buf, sizeof(c->buf));
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    if (c->resp.head_len == 0 && c->up->reused) {
+      server_retry(l, c);
+      return;
+    }
+    if (c->resp.head_len == 0) {  // closed or reset without a word: still answer the client
+      gateway_error(c->client.fd, c->hostname, 502);
+      c->rec.status = 502;
+      conn_close(l, c);
+      return;
+    }
+    // only a body that runs to the end of the connection may end here
+    if (n < 0 || resp_eof(&c->resp) < 0) {
+      conn_close(l, c);
+      return;
+    }
+    server_done(l, c, 0);
+    c->buf_len = c->pre_len = c->flush_off = 0;
+    c->post = c->chunked ? "0\r\n\r\n" : "";
+    client_flush(l, c);
+    return;
+  }
+
+  stats_add(STAT_BYTES_ORIGIN, n);
+  if ((used = resp_feed(&c->resp, c->buf, n, &body)) < 0) {
+    conn_close(l, c);
+    return;
+  }
+  if (c->stem_len == 0 && c->resp.state != RESP_HEAD) {
+    stats_time(&c->rec, PH_FIRST_BYTE, now_us() - c->t_phase);
+    if (c->stale && c->resp.status == 304) {
+      // still good: fresh again, and it is what the client gets
+      cache_stem(c->stale, c->head);
+      cache_refresh(c->stale, resp_refresh(&c->resp, c->head));
+      server_done(l, c, c->resp.keepalive && used == n);
+      c->hit = c->stale;
+      c->stale = NULL;
+      c->rec.status = head_status(c->hit->cache_obj);
+      c->rec.outcome = LOG_REVALIDATED;
+      c->state = ST_WRITE;
+      client_write_obj(l, c);
+      return;
+    }
+    // not for the cache; nor is an error when we have a stale copy, which stays
+    if (c->resp.expires < 0 || (c->stale && c->resp.status >= 500))
+      tee_drop(&c->cachebuf);
+    if (c->stale) {
+      cache_put(c->stale);  // replaced by the response, if it is cacheable
+      c->stale = NULL;
+    }
+    c->stem_len = resp_stem(&c->resp, c->head);
+    c->rec.status = c->resp.status;
+    tee_append(&c->cachebuf, c->head, c->stem_len);
+    // a body of unknown length: chunk it for HTTP/1.1, else close to end it
+    if (c->resp.clen < 0) {
+      if (c->q.http11)
+        c->chunked = c->keepalive;
+      else
+        c->keepalive = 0;
+    }
+    c->head_len = c->stem_len + client_head_end(c->head + c->stem_len, c->chunked, c->keepalive);
+    if (c->resp.clen > 0)
+      tee_expect(&c->cachebuf, c->stem_len + c->resp.clen);
+  }
+  tee_append(&c->cachebuf, c->buf, body);
+
+  c->buf_len = body;
+  c->pre_len = (c->chunked && body > 0) ? sprintf(c->pre, "%zx\r\n", body) : 0;
+  c->post = (c->chunked && body > 0) ? "\r\n" : "";
+  c->flush_off = 0;
+  if (c->resp.state == RESP_DONE) {
+    server_done(l, c, c->resp.keepalive && used == n);
+    if (c->chunked)
+      c->post = body > 0 ? "\r\n0\r\n\r\n" : "0\r\n\r\n";
+  }
+
+  // too big to cache and framed the same on both sides: splice the rest,
+  // same rule as doit()
+  if (c->cachebuf.toobig && !c->chunked
+      && (c->resp.state == RESP_BODY || c->resp.state == RESP_EOF)
+      && (c->pipefd[0] >= 0 || pipe2(c->pipefd, O_NONBLOCK | O_CLOEXEC) == 0)) {
+    fcntl(c->pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    c->splicing = 1;
+  }
+  client_flush(l, c);
+}
+
+/* Move the next piece of an uncacheable body into the pipe, then on to the client */
+static void server_splice(ev_loop *l, conn *c) {
+  size_t want = SPLICE_PIPE_SIZE;
+  ssize_t n;
+
+  if (c->resp.state == RESP_BODY && (long long)want > c->resp.left)
+    want = c->resp.left;
+  n = splice(c->server.fd, NULL, c->pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    if (n < 0 || resp_eof(&c->resp) < 0) {
+      conn_close(l, c);
+      return;
+    }
+    server_done(l, c, 0);
+    client_flush(l, c);
+    return;
+  }
+
+  c->piped = n;
+  stats_add(STAT_BYTES_ORIGIN, n);
+  if (c->resp.state == RESP_BODY) {
+    c->resp.left -= n;
+    if (c->resp.left == 0) {
+      c->resp.state = RESP_DONE;
+      server_done(l, c, c->resp.keepalive);
+    }
+  }
+  client_flush(l, c);
+}
+
+/*
+ * Write the response head, if not sent yet, and c->buf with its chunk
+ * framing to the client; stop reading the end server until it drains.
+ * Once the whole response is out, the request is done.
+ */
+static void client_flush(ev_loop *l, conn *c) {
+  struct iovec iov[4];
+  ssize_t n;
+
+  iov[0].iov_base = c->head;
+  iov[0].iov_len = c->head_len;
+  iov[1].iov_base = c->pre;
+  iov[1].iov_len = c->pre_len;
+  iov[2].iov_base = c->buf;
+  iov[2].iov_len = c->buf_len;
+  iov[3].iov_base = c->post;
+  iov[3].iov_len = strlen(c->post);
+  while (c->flush_off < iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + iov[3].iov_len) {
+    n = writev_at(c->client.fd, iov, 4, c->flush_off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        if (c->up)
+          ev_watch(l, &c->server, 0);
+        ev_watch(l, &c->client, EPOLLOUT);
+        timer_set(l, c, now_ms() + config.write_timeout * 1000LL);
+        return;
+      }
+      conn_close(l, c);
+      return;
+    }
+    c->flush_off += n;
+    c->rec.bytes += n;
+  }
+  while (c->piped > 0) {
+    n = splice(c->pipefd[0], NULL, c->client.fd, NULL, c->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        if (c->up)
+          ev_watch(l, &c->server, 0);
+        ev_watch(l, &c->client, EPOLLOUT);
+        timer_set(l, c, now_ms() + config.write_timeout * 1000LL);
+        return;
+      }
+      conn_close(l, c);
+      return;
+    }
+    c->piped -= n;
+    c->rec.bytes += n;
+  }
+
+  c->head_len = c->pre_len = c->buf_len = c->flush_off = 0;
+  c->post = "";
+  if (c->up == NULL) {  // response complete
+    request_done(l, c);
+    return;
+  }
+  ev_watch(l, &c->client, 0);
+  ev_watch(l, &c->server, EPOLLIN);
+  // the first-byte timer is left alone until the end server has sent something
+  if (c->resp.head_len > 0)
+    timer_set(l, c, now_ms() + config.read_timeout * 1000LL);
+}
+
+static void client_write_obj(ev_loop *l, conn *c) {
+  struct iovec iov[3];
+  ssize_t n;
+
+  object_iov(c->hit, iov, c->keepalive);
+  while (c->hit_off < c->hit->obj_len + iov[1].iov_len) {
+    n = writev_at(c->client.fd, iov, 3, c->hit_off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        ev_watch(l, &c->client, EPOLLOUT);
+        timer_set(l, c, now_ms() + config.write_timeout * 1000LL);
+        return;
+      }
+      conn_close(l, c);
+      return;
+    }
+    c->hit_off += n;
+    c->rec.bytes += n;
+  }
+  stats_add(STAT_BYTES_CACHE, c->hit->obj_len);
+  request_done(l, c);
+}
+
+/* The response is out: close, or wait for the client's next request */
+static void request_done(ev_loop *l, conn *c) {
+  stats_time(&c->rec, PH_TOTAL, now_us() - c->rec.start);
+  log_request(&c->rec);
+  if (!c->keepalive) {
+    conn_close(l, c);
+    return;
+  }
+
+  if (c->hit) {
+    cache_put(c->hit);
+    c->hit = NULL;
+  }
+  c->hit_off = 0;
+  c->out_len = c->out_off = 0;
+  c->stem_len = 0;
+  c->chunked = 0;
+  c->splicing = 0;
+  tee_init(&c->cachebuf);
+
+  // keep whatever the client has pipelined behind this request
+  c->req_len -= c->q.head_len;
+  memmove(c->req, c->req + c->q.head_len, c->req_len + 1);
+  req_init(&c->q);
+  c->state = ST_READ_REQ;
+  if (req_ready(l, c)) {
+    // started from loop_run(), so a run of pipelined hits doesn't recurse
+    c->next_ready = l->ready;
+    l->ready = c;
+    return;
+  }
+  if (c->state != ST_CLOSED)  // else it was malformed, and answered
+    wait_request(l, c);
+}
@@ -0,0 +1,197 @@
+/*
+ * flight.c - collapsed forwarding of cache misses
+ *
+ * The first request to miss on a URL becomes the leader of a flight and
+ * fetches it from the end server.  Requests for the same URL that miss
+ * while it is in the air join the flight instead of fetching it again,
+ * and are fed the response out of the leader's copy of it (the same
+ * cache_tee that goes into the cache) as the bytes arrive.  The leader
+ * stores the response before it lands the flight, so a request either
+ * finds the flight or finds the object in the cache.
+ *
+ * A flight carries no more than the cache could hold: if the response
+ * turns out to be bigger than cache_object_max(), the copy is dropped and
+ * the flight fails.  Followers still waiting for the head then fetch the
+ * URL on their own; ones already part way through it are cut off.  The
+ * leader's own client going away is not a failure: the leader goes on
+ * reading the response into the flight for the followers.
+ *
+ * Flights are reference counted like cache blocks: the table's entry, the
+ * leader and every follower each hold one.
+ */
+#include "proxy.h"
+
+#define FLIGHT_BUCKETS 256
+
+static flight *flights[FLIGHT_BUCKETS];
+static pthread_mutex_t flights_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static flight *flight_new(const char *key, unsigned long h) {
+  flight *f = Malloc(sizeof(flight));
+
+  f->url = strdup(key);
+  f->hash = h;
+  tee_init(&f->tee);
+  f->stem_len = 0;
+  f->clen = -1;
+  f->done = 0;
+  f->listed = 0;
+  f->refcnt = 1;
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
+  f->next = NULL;
+  return f;
+}
+
+/*
+ * flight_join - join the flight fetching url, or start one.  *leader is
+ *     set if the caller started it and has to fetch the url.  The caller
+ *     holds a reference to the flight and must flight_put() it.
+ */
+flight *flight_join(char *url, int *leader) {
+  char key[MAXLINE];
+  unsigned long h;
+  flight *f, **bucket;
+
+  cache_key(url, key);
+  h = url_hash(key);
+  bucket = &flights[h % FLIGHT_BUCKETS];
+
+  pthread_mutex_lock(&flights_mutex);
+  for (f = *bucket; f; f = f->next) {
+    if (f->hash == h && strcmp(f->url, key) == 0) {
+      __atomic_add_fetch(&f->refcnt, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&flights_mutex);
+      *leader = 0;
+      return f;
+    }
+  }
+  f = flight_new(key, h);
+  f->refcnt++;  // the table's
+  f->listed = 1;
+  f->next = *bucket;
+  *bucket = f;
+  pthread_mutex_unlock(&flights_mutex);
+
+  *leader = 1;
+  return f;
+}
+
+/* A flight nobody else can join, for fetching a url on our own */
+flight *flight_solo(char *url) {
+  char key[MAXLINE];
+
+  cache_key(url, key);
+  return flight_new(key, 0);
+}
+
+void flight_put(flight *f) {
+  if (__atomic_sub_fetch(&f->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  tee_free(&f->tee);
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->cond);
+  Free(f->url);
+  Free(f);
+}
+
+/*******************************
+ * Leader side
+ *******************************/
+
+/* The response head has arrived: stem_len bytes of it, and its Content-Length or -1 */
+void flight_head(flight *f, char *stem, size_t stem_len, long long clen) {
+  pthread_mutex_lock(&f->lock);
+  tee_append(&f->tee, stem, stem_len);
+  if (clen > 0)
+    tee_expect(&f->tee, stem_len + clen);
+  f->stem_len = stem_len;
+  f->clen = clen;
+  if (f->tee.toobig)
+    f->done = -1;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+}
+
+void flight_body(flight *f, char *data, size_t n) {
+  if (f->tee.toobig)  // only the leader changes it
+    return;
+  pthread_mutex_lock(&f->lock);
+  tee_append(&f->tee, data, n);
+  if (f->tee.toobig)
+    f->done = -1;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * flight_land - the leader is done with the fetch, which succeeded (ok)
+ *     or not.  Later misses on the url start a new flight.
+ */
+void flight_land(flight *f, int ok) {
+  flight **pp;
+  int listed = 0;
+
+  if (f->listed) {
+    pthread_mutex_lock(&flights_mutex);
+    for (pp = &flights[f->hash % FLIGHT_BUCKETS]; *pp; pp = &(*pp)->next) {
+      if (*pp == f) {
+        *pp = f->next;
+        listed = 1;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&flights_mutex);
+  }
+
+  pthread_mutex_lock(&f->lock);
+  if (f->done == 0)
+    f->done = ok ? 1 : -1;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+
+  if (listed)
+    flight_put(f);  // the table's reference
+}
+
+/*******************************
+ * Follower side
+ *******************************/
+
+/* Wait for the head; -1 if the flight failed before it arrived */
+int flight_wait_head(flight *f, size_t *stem_len, long long *clen) {
+  int rc;
+
+  pthread_mutex_lock(&f->lock);
+  while (f->done == 0 && f->stem_len == 0)
+    pthread_cond_wait(&f->cond, &f->lock);
+  rc = (f->stem_len > 0 && f->done >= 0) ? 0 : -1;
+  *stem_len = f->stem_len;
+  *clen = f->clen;
+  pthread_mutex_unlock(&f->lock);
+  return rc;
+}
+
+/*
+ * flight_read - copy up to n bytes of the response, starting off bytes
+ *     in, into buf, waiting for the leader to get that far.  Returns the
+ *     count, 0 once the whole response has been read, or -1 if the flight
+ *     failed.
+ */
+ssize_t flight_read(flight *f, size_t off, char *buf, size_t n) {
+  ssize_t rc;
+
+  pthread_mutex_lock(&f->lock);
+  while (f->done == 0 && f->tee.len <= off)
+    pthread_cond_wait(&f->cond, &f->lock);
+  if (f->done < 0) {
+    rc = -1;
+  } else {
+    rc = f->tee.len > off ? f->tee.len - off : 0;
+    if ((size_t)rc > n)
+      rc = n;
+    memcpy(buf, f->tee.buf + off, rc);
+  }
+  pthread_mutex_unlock(&f->lock);
+  return rc;
+}
@@ -0,0 +1,45 @@
+/*
+ * hist.c - HDR style latency histograms
+ *
+ * A value in microseconds goes in one of 1 << bits linear buckets within
+ * its power of two, so every bucket is within 1/(1 << bits) of the values
+ * in it, in a fixed HIST_BUCKETS(bits) counters.  Below 2 << bits each
+ * value has a bucket of its own.  The caller keeps the counters and picks
+ * bits: more is finer, and costs twice the counters per bit.
+ */
+#include "hist.h"
+
+/* The bucket us goes in */
+int hist_bucket(long long us, int bits) {
+  int msb, shift;
+
+  if (us <= 0)
+    return 0;
+  if (us >= 1LL << HIST_MAX_BIT)
+    us = (1LL << HIST_MAX_BIT) - 1;
+  msb = 63 - __builtin_clzll(us);
+  shift = msb > bits ? msb - bits : 0;
+  return (shift << bits) + (us >> shift);
+}
+
+/* The largest value bucket i holds */
+long long hist_value(int i, int bits) {
+  int sub = 1 << bits, shift;
+
+  if (i < 2 * sub)
+    return i;
+  shift = i / sub - 1;
+  return ((long long)(i % sub + sub + 1) << shift) - 1;
+}
+
+/* The value at quantile q of histogram h with n values */
+long long hist_quantile(const unsigned long *h, unsigned long n, double q, int bits) {
+  unsigned long want = q * n, seen = 0;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS(bits); i++) {
+    if ((seen += h[i]) > want)
+      return hist_value(i, bits);
+  }
+  return hist_value(HIST_BUCKETS(bits) - 1, bits);
+}
@@ -0,0 +1,17 @@
+/*
+ * hist.h - HDR style latency histograms, shared by the proxy's metrics
+ *     (stats.c) and the load generator (load-gen.c)
+ */
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#define HIST_MAX_BIT 41  /* values are capped below 2^41 us, about 25 days */
+
+/* Counters a histogram with 1 << bits buckets per power of two needs */
+#define HIST_BUCKETS(bits) ((HIST_MAX_BIT - (bits) + 1) << (bits))
+
+int hist_bucket(long long us, int bits);
+long long hist_value(int i, int bits);
+long long hist_quantile(const unsigned long *h, unsigned long n, double q, int bits);
+
+#endif /* __HIST_H__ */
@@ -0,0 +1,584 @@
+/*
+ * http.c - HTTP/1.1 request parsing and response framing for the proxy
+ *
+ * A client's request head is parsed in place in the buffer it is read
+ * into, as it arrives (req_feed()): the method, the parts of the uri and
+ * the header lines to pass on become offsets into that buffer, so the
+ * request for the end server can be written straight out of it with one
+ * writev() and no header is ever copied.
+ *
+ * Responses from end servers are run through an http_resp as they arrive,
+ * whatever the read sizes.  The scanner collects the status line and
+ * headers, works out how the body is delimited (Content-Length, chunked,
+ * or end of connection) and reports where the response ends, so that a
+ * persistent connection to the end server can carry the next request.
+ * Chunked bodies are decoded in place: what reaches the client and the
+ * cache is always plain bytes.
+ *
+ * The head also says whether the response may be cached and for how long
+ * (RFC 7234): no-store, private, Set-Cookie and Vary: * keep it out, and
+ * its freshness lifetime comes from s-maxage, max-age or Expires, else a
+ * tenth of its age since Last-Modified, else config.default_ttl.  Error
+ * responses that say nothing are cached briefly instead, for the -x 4xx=
+ * or 5xx= seconds (negative caching), so a missing or failing object
+ * doesn't cost an end server round trip per request.  Stale
+ * objects are revalidated with the validators in their stored head, or
+ * served for a grace period while that happens in the background.
+ */
+#define _GNU_SOURCE  /* strcasestr, strptime, timegm */
+#include "proxy.h"
+
+/* Hop-by-hop headers: meaningful on one connection only, never forwarded */
+static const char *hop_hdrs[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding",
+  "TE", "Trailer", "Upgrade", NULL
+};
+
+/*
+ * Client headers that make the response fit that client only.  It is
+ * shared with the cache and with every request following the fetch, so
+ * these aren't passed on; the proxy sends its own validators when it
+ * revalidates.
+ */
+static const char *private_hdrs[] = {
+  "If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since", "If-Range", "Range", NULL
+};
+
+/* Status codes cacheable without explicit freshness (RFC 7231 6.1) */
+static const int cacheable_codes[] = { 200, 203, 204, 300, 301, 404, 405, 410, 414, 501, 0 };
+
+/* Errors cached for their class's short TTL when they give no freshness of their own */
+static const int negative_codes[] = { 404, 405, 410, 414, 500, 501, 502, 503, 504, 0 };
+
+#define HEURISTIC_MAX (24 * 60 * 60)  /* cap on a Last-Modified based lifetime */
+
+static int req_line(http_req *q, char *buf, size_t off, size_t len);
+static int req_header(http_req *q, char *buf, size_t off, size_t len, size_t line_len);
+static int resp_parse_head(http_resp *r);
+static int code_in(const int *codes, int status);
+static time_t resp_expires(http_resp *r);
+static long explicit_lifetime(const char *head, time_t now);
+static long heuristic_lifetime(const char *head, time_t now);
+
+void resp_init(http_resp *r) {
+  r->state = RESP_HEAD;
+  r->head_len = 0;
+  r->status = 0;
+  r->keepalive = 0;
+  r->chunked = 0;
+  r->clen = -1;
+  r->left = 0;
+  r->line_len = 0;
+  r->expires = -1;
+}
+
+/* Is the header line at p named name? */
+int hdr_is(const char *p, const char *name) {
+  size_t n = strlen(name);
+  return strncasecmp(p, name, n) == 0 && p[n] == ':';
+}
+
+int hdr_is_hop(const char *p) {
+  int i;
+
+  for (i = 0; hop_hdrs[i]; i++) {
+    if (hdr_is(p, hop_hdrs[i]))
+      return 1;
+  }
+  return 0;
+}
+
+/* Does the n bytes at p contain word, in any case? */
+static int span_has(const char *p, size_t n, const char *word) {
+  size_t w = strlen(word), i;
+
+  for (i = 0; i + w <= n; i++) {
+    if (strncasecmp(p + i, word, w) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+void req_init(http_req *q) {
+  q->scanned = q->start = q->head_len = 0;
+  q->got_line = 0;
+  q->host_hdr.len = 0;
+  q->nhdrs = 0;
+  q->port = 80;
+  q->auth = 0;
+}
+
+/*
+ * req_feed - scan the request head in buf, n bytes so far, picking up
+ *     where the last call on q stopped; buf has to start at the same
+ *     request every time, though it may have moved.  Blank lines ahead of
+ *     the request line are skipped.  Returns 1 once the blank line that
+ *     ends the head is in, with the method and uri NUL-terminated in place,
+ *     0 if more is needed, or -1 if the head is malformed.
+ */
+int req_feed(http_req *q, char *buf, size_t n) {
+  char *p, *nl;
+  size_t len;
+
+  while (q->scanned < n) {
+    p = buf + q->scanned;
+    if ((nl = memchr(p, '\n', n - q->scanned)) == NULL)
+      return 0;  // the rest of the line is still to come
+    q->scanned = nl + 1 - buf;
+    len = nl - p;
+    if (len > 0 && p[len - 1] == '\r')
+      len--;
+
+    if (!q->got_line) {
+      if (len == 0) {
+        q->start = q->scanned;  // between requests
+        continue;
+      }
+      if (req_line(q, buf, p - buf, len) < 0)
+        return -1;
+      q->got_line = 1;
+    } else if (len == 0) {
+      q->head_len = q->scanned;
+      buf[q->method.off + q->method.len] = '\0';
+      buf[q->uri.off + q->uri.len] = '\0';
+      return 1;
+    } else if (req_header(q, buf, p - buf, len, nl + 1 - p) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* The request line, len bytes at off: method, an absolute http:// uri, version */
+static int req_line(http_req *q, char *buf, size_t off, size_t len) {
+  char *p = buf + off, *end = p + len, *u, *ue, *h;
+
+  if ((u = memchr(p, ' ', len)) == NULL)
+    return -1;
+  q->method.off = off;
+  q->method.len = u - p;
+  u++;
+  if ((ue = memchr(u, ' ', end - u)) == NULL)
+    ue = end;  // HTTP/0.9 style, no version
+  q->uri.off = u - buf;
+  q->uri.len = ue - u;
+  q->http11 = end - ue == 9 && strncasecmp(ue + 1, "HTTP/1.1", 8) == 0;
+  q->keepalive = q->http11;  // unless it says otherwise
+
+  // http://host[:port][/path]
+  if (ue - u < 7 || strncasecmp(u, "http://", 7) != 0)
+    return -1;
+  for (h = u += 7; u < ue && *u != ':' && *u != '/' && *u != '?'; u++)
+    ;
+  if (u == h)
+    return -1;
+  q->host.off = h - buf;
+  q->host.len = u - h;
+  if (u < ue && *u == ':') {
+    for (q->port = 0, h = ++u; u < ue && isdigit((unsigned char)*u); u++) {
+      if ((q->port = q->port * 10 + (*u - '0')) > 65535)
+        return -1;
+    }
+    if (u == h || q->port == 0)
+      return -1;
+  }
+  q->path.off = u - buf;
+  q->path.len = ue - u;  // may be empty: "/" is asked for
+  return 0;
+}
+
+/* A header line, len bytes at off without its line end, line_len with it */
+static int req_header(http_req *q, char *buf, size_t off, size_t len, size_t line_len) {
+  char *p = buf + off;
+  int i;
+
+  if (memchr(p, ':', len) == NULL)
+    return -1;
+  if (hdr_is(p, "Host")) {
+    q->host_hdr.off = off;
+    q->host_hdr.len = line_len;
+    return 0;
+  }
+  if (hdr_is(p, "Connection") || hdr_is(p, "Proxy-Connection")) {
+    if (span_has(p, len, "close"))
+      q->keepalive = 0;
+    else if (span_has(p, len, "keep-alive"))
+      q->keepalive = 1;
+    return 0;
+  }
+  // hop-by-hop, replaced by our own, or only for this client
+  if (hdr_is_hop(p) || hdr_is(p, "User-Agent"))
+    return 0;
+  for (i = 0; private_hdrs[i]; i++) {
+    if (hdr_is(p, private_hdrs[i]))
+      return 0;
+  }
+  if (q->nhdrs == REQ_MAXHDRS)
+    return -1;
+  q->auth |= hdr_is(p, "Authorization");
+  q->hdrs[q->nhdrs].off = off;
+  q->hdrs[q->nhdrs].len = line_len;
+  q->nhdrs++;
+  return 0;
+}
+
+/* The uri's host, copied out of buf as a string into out (MAXLINE bytes) */
+void req_host(http_req *q, const char *buf, char *out) {
+  size_t n = q->host.len < MAXLINE ? q->host.len : MAXLINE - 1;
+
+  memcpy(out, buf + q->host.off, n);
+  out[n] = '\0';
+}
+
+/*
+ * resp_feed - run the n bytes in buf through r.  Head bytes are collected
+ *     in r->head; body bytes are moved to the front of buf with any chunk
+ *     framing removed, and their count stored in *body.  Returns the number
+ *     of bytes of buf that belong to this response (less than n only when
+ *     it ends inside buf), or -1 if the response is malformed.
+ */
+ssize_t resp_feed(http_resp *r, char *buf, size_t n, size_t *body) {
+  size_t i = 0, k;
+  char c;
+
+  *body = 0;
+  while (i < n && r->state != RESP_DONE) {
+    switch (r->state) {
+    case RESP_HEAD:
+      if (r->head_len == sizeof(r->head) - 1)
+        return -1;  // head too large
+      c = r->head[r->head_len++] = buf[i++];
+      if (c == '\n' && r->head_len >= 4 && memcmp(r->head + r->head_len - 4, "\r\n\r\n", 4) == 0) {
+        r->head[r->head_len] = '\0';
+        if (resp_parse_head(r) < 0)
+          return -1;
+      }
+      break;
+
+    case RESP_BODY:     // Content-Length
+    case RESP_CHUNK:    // inside a chunk
+      k = n - i;
+      if (r->left < (long long)k)
+        k = r->left;
+      memmove(buf + *body, buf + i, k);
+      *body += k;
+      i += k;
+      r->left -= k;
+      if (r->left == 0)
+        r->state = (r->state == RESP_BODY) ? RESP_DONE : RESP_CHUNK_END;
+      break;
+
+    case RESP_EOF:      // until the end server closes
+      memmove(buf + *body, buf + i, n - i);
+      *body += n - i;
+      i = n;
+      break;
+
+    case RESP_CHUNK_SIZE:  // hex size, then optional extensions, then CRLF
+      c = buf[i++];
+      if (c == '\n') {
+        if (r->line_len == 0)
+          return -1;
+        r->state = (r->left == 0) ? RESP_TRAILER : RESP_CHUNK;
+        r->line_len = 0;
+      } else if (r->line_len >= 0 && isxdigit((unsigned char)c)) {
+        if (r->left > (1LL << 40))
+          return -1;
+        r->left = r->left * 16 + (isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10);
+        r->line_len++;
+      } else if (c != '\r' && r->line_len > 0) {
+        r->line_len = -r->line_len;  // extension: ignore the rest of the line
+      } else if (c != '\r' && r->line_len == 0) {
+        return -1;
+      }
+      break;
+
+    case RESP_CHUNK_END:   // CRLF after the chunk data
+      if (buf[i++] == '\n') {
+        r->state = RESP_CHUNK_SIZE;
+        r->left = 0;
+        r->line_len = 0;
+      }
+      break;
+
+    case RESP_TRAILER:     // trailer lines, then an empty line
+      c = buf[i++];
+      if (c == '\n') {
+        if (r->line_len == 0)
+          r->state = RESP_DONE;
+        r->line_len = 0;
+      } else if (c != '\r') {
+        r->line_len++;
+      }
+      break;
+    }
+  }
+  return i;
+}
+
+/* The end server closed the connection: fine only for a body delimited that way */
+int resp_eof(http_resp *r) {
+  if (r->state != RESP_EOF)
+    return -1;
+  r->state = RESP_DONE;
+  return 0;
+}
+
+/* The head is complete: pick out what framing and persistence depend on */
+static int resp_parse_head(http_resp *r) {
+  char *p, *end;
+  int minor, conn_close = 0, conn_keepalive = 0;
+
+  if (sscanf(r->head, "HTTP/1.%d %d", &minor, &r->status) != 2)
+    return -1;
+
+  for (p = strchr(r->head, '\n') + 1; *p != '\r' && *p != '\n'; p = strchr(p, '\n') + 1) {
+    if (hdr_is(p, "Content-Length")) {
+      r->clen = strtoll(p + 15, &end, 10);
+      if (end == p + 15 || r->clen < 0)
+        return -1;
+    } else if (hdr_is(p, "Transfer-Encoding")) {
+      end = strchr(p, '\n');
+      *end = '\0';
+      r->chunked = strcasestr(p, "chunked") != NULL;
+      *end = '\n';
+    } else if (hdr_is(p, "Connection")) {
+      end = strchr(p, '\n');
+      *end = '\0';
+      conn_close |= strcasestr(p, "close") != NULL;
+      conn_keepalive |= strcasestr(p, "keep-alive") != NULL;
+      *end = '\n';
+    }
+  }
+
+  // HTTP/1.1 persists unless told otherwise; HTTP/1.0 only if asked to
+  r->keepalive = minor >= 1 ? !conn_close : conn_keepalive;
+
+  if ((r->status >= 100 && r->status < 200) || r->status == 204 || r->status == 304) {
+    r->clen = 0;
+    r->state = RESP_DONE;
+  } else if (r->chunked) {
+    r->clen = -1;  // Transfer-Encoding wins over Content-Length
+    r->state = RESP_CHUNK_SIZE;
+    r->left = 0;
+    r->line_len = 0;
+  } else if (r->clen >= 0) {
+    r->state = r->clen ? RESP_BODY : RESP_DONE;
+    r->left = r->clen;
+  } else {
+    r->state = RESP_EOF;
+    r->keepalive = 0;
+  }
+  r->expires = resp_expires(r);
+  return 0;
+}
+
+/*
+ * hdr_value - the value of the first header called name in the
+ *     NUL-terminated head, copied into out (n bytes), or NULL if there is
+ *     none.
+ */
+char *hdr_value(const char *head, const char *name, char *out, size_t n) {
+  const char *p, *v, *end;
+  size_t len;
+
+  for (p = strchr(head, '\n'); p && p[1] != '\r' && p[1] != '\n' && p[1]; p = strchr(p + 1, '\n')) {
+    if (!hdr_is(p + 1, name))
+      continue;
+    v = p + 1 + strlen(name) + 1;
+    v += strspn(v, " \t");
+    end = v + strcspn(v, "\r\n");
+    len = end - v < (long)n - 1 ? (size_t)(end - v) : n - 1;
+    memcpy(out, v, len);
+    out[len] = '\0';
+    return out;
+  }
+  return NULL;
+}
+
+/* The status code on the status line that starts head, 0 if there isn't one */
+int head_status(const char *head) {
+  return strncmp(head, "HTTP/1.", 7) == 0 ? atoi(head + 9) : 0;
+}
+
+/* An HTTP-date (RFC 1123 form), or -1 */
+time_t http_date(const char *v) {
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  if (v == NULL || strptime(v, "%a, %d %b %Y %H:%M:%S", &tm) == NULL)
+    return -1;
+  return timegm(&tm);
+}
+
+/* The Cache-Control directive dir (e.g. "max-age") in cc, as a number if it has one */
+static int cc_directive(const char *cc, const char *dir, long *val) {
+  const char *p = cc;
+  size_t n = strlen(dir);
+
+  while ((p = strcasestr(p, dir)) != NULL) {
+    if ((p == cc || p[-1] == ',' || p[-1] == ' ') && (p[n] == '\0' || p[n] == ',' || p[n] == ' ' || p[n] == '=')) {
+      if (val)
+        *val = p[n] == '=' ? strtol(p + n + 1 + (p[n + 1] == '"'), NULL, 10) : -1;
+      return 1;
+    }
+    p += n;
+  }
+  return 0;
+}
+
+/* Freshness the head gives itself: s-maxage, max-age or Expires; -1 if none */
+static long explicit_lifetime(const char *head, time_t now) {
+  char cc[MAXLINE], v[MAXLINE];
+  time_t date, expires;
+  long n;
+
+  if (hdr_value(head, "Cache-Control", cc, sizeof(cc))) {
+    if (cc_directive(cc, "no-cache", NULL))
+      return 0;  // may be stored, but has to be revalidated every time
+    if (cc_directive(cc, "s-maxage", &n) && n >= 0)
+      return n;
+    if (cc_directive(cc, "max-age", &n) && n >= 0)
+      return n;
+  }
+  if (hdr_value(head, "Expires", v, sizeof(v))) {
+    if ((expires = http_date(v)) < 0)
+      return 0;  // invalid dates, "0" among them, mean already expired
+    date = http_date(hdr_value(head, "Date", v, sizeof(v)));
+    return expires - (date >= 0 ? date : now);
+  }
+  return -1;
+}
+
+/* Freshness for a head that gives none: a tenth of its age when it was sent, or the default */
+static long heuristic_lifetime(const char *head, time_t now) {
+  char v[MAXLINE];
+  time_t date, modified;
+  long n;
+
+  if ((modified = http_date(hdr_value(head, "Last-Modified", v, sizeof(v)))) < 0)
+    return config.default_ttl;
+  if ((date = http_date(hdr_value(head, "Date", v, sizeof(v)))) < 0)
+    date = now;
+  n = (date - modified) / 10;
+  return n < 0 ? 0 : n > HEURISTIC_MAX ? HEURISTIC_MAX : n;
+}
+
+static int code_in(const int *codes, int status) {
+  while (*codes && *codes != status)
+    codes++;
+  return *codes != 0;
+}
+
+/* When the response goes stale if it is cached, or -1 if it mustn't be */
+static time_t resp_expires(http_resp *r) {
+  char v[MAXLINE];
+  time_t now = time(NULL);
+  long life, age = 0;
+
+  if (r->status == 304 || r->status == 206)
+    return -1;  // answers one client's validators or range, not the url
+  if (hdr_value(r->head, "Cache-Control", v, sizeof(v))
+      && (cc_directive(v, "no-store", NULL) || cc_directive(v, "private", NULL)))
+    return -1;
+  if (hdr_value(r->head, "Set-Cookie", v, sizeof(v)))
+    return -1;  // meant for one client
+  if (hdr_value(r->head, "Vary", v, sizeof(v)) && strchr(v, '*'))
+    return -1;
+
+  if ((life = explicit_lifetime(r->head, now)) < 0) {
+    if (code_in(negative_codes, r->status)) {
+      if ((life = r->status < 500 ? config.neg_ttl_4xx : config.neg_ttl_5xx) <= 0)
+        return -1;
+    } else if (code_in(cacheable_codes, r->status)) {
+      life = heuristic_lifetime(r->head, now);
+    } else {
+      return -1;
+    }
+  }
+  if (hdr_value(r->head, "Age", v, sizeof(v)))
+    age = strtol(v, NULL, 10);
+  life -= age;
+
+  // nothing to revalidate with: only worth keeping while fresh
+  if (life <= 0 && !hdr_value(r->head, "ETag", v, sizeof(v))
+      && !hdr_value(r->head, "Last-Modified", v, sizeof(v)))
+    return -1;
+  return now + (life > 0 ? life : 0);
+}
+
+/*
+ * resp_refresh - a 304 (r) for the cached object whose stored head is
+ *     stem: when the object goes stale again.  The 304's own freshness
+ *     wins, else the stored head's, counted from now.
+ */
+time_t resp_refresh(http_resp *r, const char *stem) {
+  time_t now = time(NULL);
+  long life;
+
+  if ((life = explicit_lifetime(r->head, now)) < 0
+      && (life = explicit_lifetime(stem, now)) < 0)
+    life = heuristic_lifetime(stem, now);
+  return now + (life > 0 ? life : 0);
+}
+
+/*
+ * cond_headers - the If-None-Match and If-Modified-Since lines that
+ *     revalidate a cached object with stored head stem, written to out.
+ *     Returns the length, 0 if the head has no validators.
+ */
+size_t cond_headers(const char *stem, char *out) {
+  char v[MAXLINE / 4];
+  size_t n = 0;
+
+  if (hdr_value(stem, "ETag", v, sizeof(v)))
+    n += sprintf(out + n, "If-None-Match: %s\r\n", v);
+  if (hdr_value(stem, "Last-Modified", v, sizeof(v)))
+    n += sprintf(out + n, "If-Modified-Since: %s\r\n", v);
+  return n;
+}
+
+/*
+ * stale_grace - how long after it expires the object with stored head
+ *     stem may still be served while it is refreshed: its
+ *     stale-while-revalidate (RFC 5861), else config.stale_grace, and
+ *     never if it must be revalidated first.
+ */
+long stale_grace(const char *stem) {
+  char cc[MAXLINE];
+  long n;
+
+  if (!hdr_value(stem, "Cache-Control", cc, sizeof(cc)))
+    return config.stale_grace;
+  if (cc_directive(cc, "no-cache", NULL) || cc_directive(cc, "must-revalidate", NULL)
+      || cc_directive(cc, "proxy-revalidate", NULL))
+    return 0;
+  if (cc_directive(cc, "stale-while-revalidate", &n) && n >= 0)
+    return n;
+  return config.stale_grace;
+}
+
+/*
+ * resp_stem - copy the response head into out without hop-by-hop headers
+ *     and without the blank line that ends it, so the sender can add its
+ *     own Connection header.  Returns the length.
+ */
+size_t resp_stem(http_resp *r, char *out) {
+  char *p = r->head, *q, *o = out;
+  size_t n;
+
+  // status line
+  q = strchr(p, '\n') + 1;
+  memcpy(o, p, q - p);
+  o += q - p;
+
+  for (p = q; *p != '\r' && *p != '\n'; p = q) {
+    q = strchr(p, '\n') + 1;
+    if (hdr_is_hop(p))
+      continue;
+    n = q - p;
+    memcpy(o, p, n);
+    o += n;
+  }
+  return o - out;
+}
@@ -0,0 +1,393 @@
+/*
+ * load-gen.c - throughput and latency of the proxy (or Tiny) under load
+ *
+ * Each of conns connections is a thread that sends GET requests for the
+ * urls on the command line for a fixed time, picked by Zipf popularity:
+ * the k-th url (from 0) is asked for in proportion to 1/(k+1)^s.  A url
+ * with %d in it stands for -n urls, %d running from 0.  With -x the
+ * requests go to that proxy with absolute uris, else straight to the
+ * urls' server (they must all be on one).
+ *
+ * Closed loop (the default), a connection sends its next request as soon
+ * as the last one is answered, so the load eases off whenever the server
+ * slows down.  Open loop (-r rate), the requests are sent on a fixed
+ * schedule of rate per second over all the connections, whether or not
+ * the server keeps up.  A request's latency then runs from when the
+ * schedule said it should have gone out, not from when it got to go out
+ * behind a slow one: that is the coordinated omission correction, and
+ * without it a stall shows up as a single slow request instead of every
+ * request that queued behind it.  The service time, from the actual
+ * send, is printed next to it; at low load the two differ by this
+ * program's own wakeup lag, some tens of us.
+ *
+ * With -k the connections are kept alive between requests as long as the
+ * server lets them, else each request is on a new connection.
+ *
+ * Latencies go in HDR style histograms (hist.c), like stats.c's but with
+ * finer buckets: within 1/32 of the true value.
+ *
+ *   (cd tiny; ./tiny 15213) &  ./proxy 15214 &
+ *   ./loadgen -x localhost:15214 -c 32 -k -d 10 http://localhost:15213/home.html \
+ *             http://localhost:15213/tiny.c http://localhost:15213/godzilla.jpg
+ *
+ * usage: loadgen [-c conns] [-d seconds] [-r rate] [-k] [-x proxyhost:port]
+ *                [-n nurls] [-s zipf_s] [-T timeout] url...
+ */
+#define _GNU_SOURCE  /* strcasestr() */
+#include <math.h>
+#include "csapp.h"
+#include "hist.h"
+
+#define HIST_SUB_BITS 5  /* 32 buckets per power of two */
+#define HIST_N        HIST_BUCKETS(HIST_SUB_BITS)
+#define MAX_CONNS     4096
+
+/* What one connection saw; summed when the run is over */
+typedef struct {
+  unsigned long lat[HIST_N];  // from the intended send time
+  unsigned long svc[HIST_N];  // from the actual send time
+  long long lat_max, svc_max;
+  unsigned long requests;           // answered in full
+  unsigned long status[6];          // by hundreds: 1xx .. 5xx
+  unsigned long errors;             // connect, write, read or parse failures
+  unsigned long connects;
+  unsigned long bytes;              // body bytes
+  unsigned seed;
+  int id;
+} conn_stats;
+
+static char **reqs;          // the request for each url, ready to write
+static size_t *req_lens;
+static double *cdf;          // cumulative Zipf weights, for pick_url()
+static int nurls;
+static char *host, *port;    // where the connections go
+static int conns = 1, keepalive, timeout = 5;
+static double rate;          // requests/s over all connections, 0 for a closed loop
+static long long t_start, t_end;  // us
+
+static long long now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(long long us) {
+  struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/* Index of a url drawn by Zipf popularity */
+static int pick_url(unsigned *seed) {
+  double r = rand_r(seed) / (RAND_MAX + 1.0) * cdf[nurls - 1];
+  int lo = 0, hi = nurls - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cdf[mid] < r)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * read_response - read one response off rp, counting its body bytes in
+ *     s.  Returns its status, with *reuse set if the connection can carry
+ *     another request, or -1 if the response was cut short or didn't
+ *     parse.
+ */
+static int read_response(rio_t *rp, conn_stats *s, int *reuse) {
+  char buf[MAXBUF];
+  long long clen = -1, chunk;
+  int status, minor, chunked = 0, close_hdr = 0, keep_hdr = 0;
+  ssize_t n;
+
+  if (rio_readlineb(rp, buf, MAXLINE) <= 0 || sscanf(buf, "HTTP/1.%d %d", &minor, &status) != 2)
+    return -1;
+  while (1) {
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+      return -1;
+    if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+      break;
+    if (!strncasecmp(buf, "Content-Length:", 15))
+      clen = atoll(buf + 15);
+    else if (!strncasecmp(buf, "Transfer-Encoding:", 18))
+      chunked = strcasestr(buf, "chunked") != NULL;
+    else if (!strncasecmp(buf, "Connection:", 11)) {
+      close_hdr |= strcasestr(buf, "close") != NULL;
+      keep_hdr |= strcasestr(buf, "keep-alive") != NULL;
+    }
+  }
+  *reuse = keepalive && !close_hdr && (minor >= 1 || keep_hdr);
+
+  if (status == 204 || status == 304 || (status >= 100 && status < 200))
+    return status;
+  if (chunked) {
+    while (1) {
+      if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+        return -1;
+      if ((chunk = strtoll(buf, NULL, 16)) == 0)
+        break;
+      for (chunk += 2; chunk > 0; chunk -= n) {  // the data and its CRLF
+        if ((n = rio_readnb(rp, buf, chunk < (long long)sizeof(buf) ? chunk : (long long)sizeof(buf))) <= 0)
+          return -1;
+        s->bytes += n;
+      }
+      s->bytes -= 2;
+    }
+    do {  // trailer, up to the blank line
+      if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+        return -1;
+    } while (strcmp(buf, "\r\n") && strcmp(buf, "\n"));
+    return status;
+  }
+  if (clen < 0) {  // the body runs to the end of the connection
+    *reuse = 0;
+    while ((n = rio_readnb(rp, buf, sizeof(buf))) > 0)
+      s->bytes += n;
+    return n < 0 ? -1 : status;
+  }
+  for (; clen > 0; clen -= n) {
+    if ((n = rio_readnb(rp, buf, clen < (long long)sizeof(buf) ? clen : (long long)sizeof(buf))) <= 0)
+      return -1;
+    s->bytes += n;
+  }
+  return status;
+}
+
+static void record(unsigned long *h, long long *max, long long us) {
+  h[hist_bucket(us, HIST_SUB_BITS)]++;
+  if (us > *max)
+    *max = us;
+}
+
+/* One connection's requests until t_end */
+static void *conn_thread(void *vargp) {
+  conn_stats *s = vargp;
+  struct timeval tv = { timeout, 0 };
+  long long intended, sent, done, interval = 0;
+  int fd = -1, status, reuse = 0, u;
+  rio_t rio;
+
+  if (rate > 0) {
+    // this connection's share of the schedule, staggered against the others
+    interval = conns * 1e6 / rate;
+    intended = t_start + s->id * 1e6 / rate;
+  } else
+    intended = t_start;
+
+  while (intended < t_end) {
+    if (rate > 0)
+      sleep_until(intended);
+    else if ((intended = now_us()) >= t_end)
+      break;
+
+    if (fd < 0) {
+      if ((fd = open_clientfd(host, port)) < 0) {
+        s->errors++;
+        if (rate == 0)
+          usleep(10000);  // don't spin on a server that is down
+        intended += interval;
+        continue;
+      }
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      Rio_readinitb(&rio, fd);
+      s->connects++;
+    }
+
+    u = pick_url(&s->seed);
+    sent = now_us();
+    if (rio_writen(fd, reqs[u], req_lens[u]) < 0 || (status = read_response(&rio, s, &reuse)) < 0) {
+      s->errors++;
+      close(fd);
+      fd = -1;
+      intended += interval;
+      continue;
+    }
+    done = now_us();
+    record(s->lat, &s->lat_max, done - intended);
+    record(s->svc, &s->svc_max, done - sent);
+    s->requests++;
+    s->status[status / 100 < 6 ? status / 100 : 0]++;
+    if (!reuse) {
+      close(fd);
+      fd = -1;
+    }
+    intended += interval;
+  }
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+/* Split http://host[:port][/path] into out_host, out_port and out_path */
+static void split_url(char *url, char *out_host, char *out_port, char *out_path) {
+  char *h, *p;
+  size_t n;
+
+  if (strncasecmp(url, "http://", 7))
+    app_error("loadgen: urls have to start with http://");
+  h = url + 7;
+  n = strcspn(h, ":/");
+  if (n == 0 || n >= MAXLINE)
+    app_error("loadgen: bad url");
+  memcpy(out_host, h, n);
+  out_host[n] = '\0';
+  p = h + n;
+  strcpy(out_port, "80");
+  if (*p == ':') {
+    n = strcspn(++p, "/");
+    if (n == 0 || n > 5)
+      app_error("loadgen: bad port in url");
+    memcpy(out_port, p, n);
+    out_port[n] = '\0';
+    p += n;
+  }
+  strcpy(out_path, *p ? p : "/");
+}
+
+/* Expand the urls on the command line and build a request for each */
+static void make_requests(char **urls, int count, int n, double s, char *proxy) {
+  char url[MAXLINE], uhost[MAXLINE], uport[MAXLINE], path[MAXLINE], buf[3 * MAXLINE], *d;
+  int i, j, k, each;
+  double sum = 0;
+
+  for (i = 0, nurls = 0; i < count; i++)
+    nurls += strstr(urls[i], "%d") ? n : 1;
+  reqs = Malloc(nurls * sizeof(char *));
+  req_lens = Malloc(nurls * sizeof(size_t));
+  cdf = Malloc(nurls * sizeof(double));
+
+  for (i = 0, k = 0; i < count; i++) {
+    each = strstr(urls[i], "%d") ? n : 1;
+    for (j = 0; j < each; j++, k++) {
+      if (strlen(urls[i]) + 16 > MAXLINE)
+        app_error("loadgen: url too long");
+      if ((d = strstr(urls[i], "%d")) != NULL)
+        snprintf(url, sizeof(url), "%.*s%d%s", (int)(d - urls[i]), urls[i], j, d + 2);
+      else
+        strcpy(url, urls[i]);
+      split_url(url, uhost, uport, path);
+      if (proxy == NULL) {
+        if (host == NULL) {
+          host = strdup(uhost);
+          port = strdup(uport);
+        } else if (strcmp(host, uhost) || strcmp(port, uport))
+          app_error("loadgen: without -x every url has to be on the same server");
+      }
+      req_lens[k] = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s%s%s\r\nConnection: %s\r\n\r\n",
+                             proxy ? url : path, uhost, strcmp(uport, "80") ? ":" : "",
+                             strcmp(uport, "80") ? uport : "", keepalive ? "keep-alive" : "close");
+      reqs[k] = strdup(buf);
+      cdf[k] = (sum += 1.0 / pow(k + 1, s));
+    }
+  }
+}
+
+static void print_latency(char *what, unsigned long *h, unsigned long n, long long max) {
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  long long v;
+  int q;
+
+  printf("  %-10s", what);
+  for (q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++) {
+    v = hist_quantile(h, n, quantiles[q], HIST_SUB_BITS);  // the top of its bucket, which may be past the max
+    printf("  p%g %.3f", quantiles[q] * 100, (v < max ? v : max) / 1e3);
+  }
+  printf("  max %.3f ms\n", max / 1e3);
+}
+
+int main(int argc, char **argv) {
+  int opt, i, j, seconds = 10, n = 100;
+  char *proxy = NULL, *colon;
+  double s = 1.0, elapsed;
+  pthread_t *tids;
+  conn_stats *st, *t;
+
+  while ((opt = getopt(argc, argv, "c:d:r:kx:n:s:T:")) != -1) {
+    switch (opt) {
+    case 'c': conns = atoi(optarg); break;
+    case 'd': seconds = atoi(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'k': keepalive = 1; break;
+    case 'x': proxy = optarg; break;
+    case 'n': n = atoi(optarg); break;
+    case 's': s = atof(optarg); break;
+    case 'T': timeout = atoi(optarg); break;
+    default:
+      goto usage;
+    }
+  }
+  if (optind == argc)
+    goto usage;
+  if (conns <= 0 || conns > MAX_CONNS || seconds <= 0 || rate < 0 || n <= 0 || s < 0 || timeout <= 0)
+    app_error("loadgen: bad arguments");
+  if (proxy) {
+    if ((colon = strrchr(proxy, ':')) == NULL)
+      app_error("loadgen: -x wants host:port");
+    *colon = '\0';
+    host = proxy;
+    port = colon + 1;
+  }
+  make_requests(argv + optind, argc - optind, n, s, proxy);
+  signal(SIGPIPE, SIG_IGN);
+
+  tids = Malloc(conns * sizeof(pthread_t));
+  st = Calloc(conns, sizeof(conn_stats));
+  t_start = now_us() + 10000;  // a moment for every thread to get going
+  t_end = t_start + seconds * 1000000LL;
+  for (i = 0; i < conns; i++) {
+    st[i].id = i;
+    st[i].seed = i + 1;
+    Pthread_create(&tids[i], NULL, conn_thread, &st[i]);
+  }
+  for (i = 0; i < conns; i++)
+    Pthread_join(tids[i], NULL);
+  elapsed = (now_us() - t_start) / 1e6;
+
+  // everything into st[0]
+  t = &st[0];
+  for (i = 1; i < conns; i++) {
+    for (j = 0; j < HIST_N; j++) {
+      t->lat[j] += st[i].lat[j];
+      t->svc[j] += st[i].svc[j];
+    }
+    t->lat_max = st[i].lat_max > t->lat_max ? st[i].lat_max : t->lat_max;
+    t->svc_max = st[i].svc_max > t->svc_max ? st[i].svc_max : t->svc_max;
+    t->requests += st[i].requests;
+    for (j = 0; j < 6; j++)
+      t->status[j] += st[i].status[j];
+    t->errors += st[i].errors;
+    t->connects += st[i].connects;
+    t->bytes += st[i].bytes;
+  }
+
+  if (rate > 0)
+    printf("open loop at %.0f req/s", rate);
+  else
+    printf("closed loop");
+  printf(", %d connections%s, %d urls (zipf s=%g)%s%s:%s, %.1f s\n", conns, keepalive ? " kept alive" : "",
+         nurls, s, proxy ? " via proxy " : " to ", host, port, elapsed);
+  printf("  requests    %lu (%.1f/s), %.2f MB/s of body, %lu connects, %lu errors\n", t->requests,
+         t->requests / elapsed, t->bytes / elapsed / 1e6, t->connects, t->errors);
+  printf("  status      2xx %lu  3xx %lu  4xx %lu  5xx %lu  other %lu\n",
+         t->status[2], t->status[3], t->status[4], t->status[5], t->status[0] + t->status[1]);
+  if (t->requests == 0)
+    exit(1);
+  if (rate > 0) {
+    print_latency("latency", t->lat, t->requests, t->lat_max);
+    print_latency("service", t->svc, t->requests, t->svc_max);
+  } else
+    print_latency("latency", t->svc, t->requests, t->svc_max);
+  exit(0);
+
+ usage:
+  fprintf(stderr, "usage: %s [-c conns] [-d seconds] [-r rate] [-k] [-x proxyhost:port]\n"
+                  "       [-n nurls] [-s zipf_s] [-T timeout] url...\n", argv[0]);
+  exit(1);
+}
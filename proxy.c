@@ -1,374 +1,1025 @@
+#define _GNU_SOURCE  /* splice, pipe2 */
 #include <stdio.h>
-#include "csapp.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1024000
-#define MAX_OBJECT_SIZE 102400
-#define LRU_MAGIC_NUMBER 9999
-// Least Recently Used
-// LRU: 가장 오랫동안 참조되지 않은 페이지를 교체하는 기법
-
-#define CACHE_OBJS_COUNT 10
+#include <poll.h>
+#include "proxy.h"
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
-static const char *requestline_hdr_format = "GET %s HTTP/1.0\r\n";
-static const char *endof_hdr = "\r\n";
-static const char *host_hdr_format = "Host: %s\r\n";
-static const char *conn_hdr = "Connection: close\r\n";
-static const char *prox_hdr = "Proxy-Connection: close\r\n";
-
-static const char *host_key = "Host";
-static const char *connection_key = "Connection";
-static const char *proxy_connection_key = "Proxy-Connection";
-static const char *user_agent_key = "User-Agent";
+static const char *conn_hdr = "Connection: keep-alive\r\n";  // to the end server, see upstream.c
 
 void *thread(void *vargsp);
+void *worker(void *vargp);
+void *snapshot_thread(void *vargp);
 void doit(int connfd);
-void parse_uri(char *uri, char *hostname, char *path, int *port);
-void build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio);
-int connect_endServer(char *hostname, int port, char *http_header);
-
-// cache function
-void cache_init();
-int cache_find(char *url);
-void cache_uri(char *uri, char *buf);
-
-void readerPre(int i);
-void readerAfter(int i);
-
-typedef struct 
-{
-  char cache_obj[MAX_OBJECT_SIZE];
-  char cache_url[MAXLINE];
-  int LRU; // least recently used 가장 최근에 사용한 것의 우선순위를 뒤로 미룸(캐시에서 삭제할 때)
-  int isEmpty; // 이 블럭에 캐시 정보가 들었는지 Empty인지 체크
-
-  int readCnt;  // count of readers
-  sem_t wmutex;  // protects accesses to cache 세마포어 타입 1: 사용가능, 0: 사용불가능
-  sem_t rdcntmutex;  // protects accesses to readcnt
-} cache_block;   //캐시 블럭 구조체로 선언
-
-
-typedef struct
-{
-  cache_block cacheobjs[CACHE_OBJS_COUNT];  // ten cache blocks
-  int cache_num;    // 캐시(10개) 넘버 부여
-} Cache;
+static int forward_request(int connfd, upstream *u, struct iovec *req, int reqcnt, flight *f,
+                           cache_block *stale, int http11, int *keepalive, access_rec *rec);
+static int follow_flight(int connfd, flight *f, int http11, int *keepalive, access_rec *rec);
+static int serve_request(int connfd, rio_t *rio);
+static int read_request(rio_t *rp, http_req *q, access_rec *rec);
+static int handle_request(int connfd, char *head, http_req *q, access_rec *rec);
+static int send_object(int fd, cache_block *b, int keepalive, access_rec *rec);
+static int accept_batch(int listenfd, int *fds, int max);
+void usage(char *prog);
+size_t parse_size(char *s);
 
 Cache cache;
+proxy_config config = {
+  .mode = MODE_THREAD,
+  .nworkers = NWORKERS,
+  .queue_depth = QUEUE_DEPTH,
+  .overload = OVERLOAD_BLOCK,
+  .backlog = LISTEN_BACKLOG,
+  .cache_size = MAX_CACHE_SIZE,
+  .object_size = MAX_OBJECT_SIZE,
+  .cache_shards = CACHE_SHARDS,
+  .admission = ADMIT_TINYLFU,
+  .upstream_idle_max = UPSTREAM_IDLE_MAX,
+  .upstream_idle = UPSTREAM_IDLE,
+  .client_idle = CLIENT_IDLE,
+  .dns_ttl = DNS_TTL,
+  .dns_neg_ttl = DNS_NEG_TTL,
+  .connect_timeout = CONNECT_TIMEOUT,
+  .header_timeout = HEADER_TIMEOUT,
+  .first_byte_timeout = FIRST_BYTE_TIMEOUT,
+  .read_timeout = READ_TIMEOUT,
+  .write_timeout = WRITE_TIMEOUT,
+  .disk_size = DISK_SIZE,
+  .default_ttl = DEFAULT_TTL,
+  .stale_grace = STALE_GRACE,
+  .neg_ttl_4xx = NEG_TTL_4XX,
+  .neg_ttl_5xx = NEG_TTL_5XX,
+  .neg_connect_ttl = NEG_TTL_CONNECT,
+  .metrics_port = NULL,
+  .access_log = NULL,
+};
+sbuf_t sbuf;  // connfds waiting for a pool worker
 
 
 int main(int argc, char **argv) {
-  int listenfd, *connfdp;
-  socklen_t clientlen;
-  char hostname[MAXLINE], port[MAXLINE];
+  int listenfd, connfd, opt, i, n;
+  int fds[ACCEPT_BATCH];
   pthread_t tid;
-  struct sockaddr_storage clientaddr;
+  sigset_t sigs;
 
-  cache_init();
+  while ((opt = getopt(argc, argv, "m:n:w:q:o:C:O:s:u:U:k:T:N:c:H:F:R:W:D:Z:S:E:G:A:x:M:L:b:")) != -1) {
+    switch (opt) {
+    case 'm':
+      if (!strcmp(optarg, "thread"))
+        config.mode = MODE_THREAD;
+      else if (!strcmp(optarg, "epoll"))
+        config.mode = MODE_EPOLL;
+      else if (!strcmp(optarg, "pool"))
+        config.mode = MODE_POOL;
+      else
+        usage(argv[0]);
+      break;
+    case 'n':   // number of event loops for -m epoll
+      config.nloops = atoi(optarg);
+      break;
+    case 'w':   // number of workers for -m pool
+      config.nworkers = atoi(optarg);
+      break;
+    case 'q':   // connection queue depth for -m pool
+      config.queue_depth = atoi(optarg);
+      break;
+    case 'o':   // what -m pool does when the queue is full
+      if (!strcmp(optarg, "block"))
+        config.overload = OVERLOAD_BLOCK;
+      else if (!strcmp(optarg, "503"))
+        config.overload = OVERLOAD_503;
+      else
+        usage(argv[0]);
+      break;
+    case 'b':   // listen backlog
+      config.backlog = atoi(optarg);
+      break;
+    case 'C':   // cache budget, e.g. 64m
+      config.cache_size = parse_size(optarg);
+      break;
+    case 'O':   // largest cacheable object, e.g. 1m
+      config.object_size = parse_size(optarg);
+      break;
+    case 's':   // cache shards
+      config.cache_shards = atoi(optarg);
+      break;
+    case 'A':   // cache admission policy
+      if (!strcmp(optarg, "tinylfu"))
+        config.admission = ADMIT_TINYLFU;
+      else if (!strcmp(optarg, "all"))
+        config.admission = ADMIT_ALL;
+      else
+        usage(argv[0]);
+      break;
+    case 'u':   // idle end server connections parked per host, 0 to close each one
+      config.upstream_idle_max = atoi(optarg);
+      break;
+    case 'U':   // seconds an idle end server connection is kept
+      config.upstream_idle = atoi(optarg);
+      break;
+    case 'k':   // seconds a keep-alive client may sit idle, 0 to close after each response
+      config.client_idle = atoi(optarg);
+      break;
+    case 'T':   // seconds a resolved end server name is cached, 0 to resolve every time
+      config.dns_ttl = atoi(optarg);
+      break;
+    case 'N':   // seconds a failed lookup is cached
+      config.dns_neg_ttl = atoi(optarg);
+      break;
+    case 'c':   // ms to wait for an end server connection
+      config.connect_timeout = atoi(optarg);
+      break;
+    case 'H':   // seconds a client has to send its request headers
+      config.header_timeout = atoi(optarg);
+      break;
+    case 'F':   // seconds to wait for an end server to start answering
+      config.first_byte_timeout = atoi(optarg);
+      break;
+    case 'R':   // seconds an end server may stall mid-response
+      config.read_timeout = atoi(optarg);
+      break;
+    case 'W':   // seconds a client may stall our writes
+      config.write_timeout = atoi(optarg);
+      break;
+    case 'D':   // file for the on-disk cache tier
+      config.disk_path = optarg;
+      break;
+    case 'Z':   // its size, e.g. 4g
+      config.disk_size = parse_size(optarg);
+      break;
+    case 'S':   // cache snapshot file: saved on SIGUSR2 and shutdown, restored at startup
+      config.snapshot_path = optarg;
+      break;
+    case 'E':   // seconds a response that says nothing about its freshness stays fresh
+      config.default_ttl = atoi(optarg);
+      break;
+    case 'G':   // seconds past expiry a hit is served stale while it is refreshed, 0 for never
+      config.stale_grace = atoi(optarg);
+      break;
+    case 'x':   // negative caching: 4xx=secs, 5xx=secs or connect=secs, 0 to turn it off
+      if (!strncmp(optarg, "4xx=", 4))
+        config.neg_ttl_4xx = atoi(optarg + 4);
+      else if (!strncmp(optarg, "5xx=", 4))
+        config.neg_ttl_5xx = atoi(optarg + 4);
+      else if (!strncmp(optarg, "connect=", 8))
+        config.neg_connect_ttl = atoi(optarg + 8);
+      else
+        usage(argv[0]);
+      break;
+    case 'M':   // admin port serving the metrics page
+      config.metrics_port = optarg;
+      break;
+    case 'L':   // access log file
+      config.access_log = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || config.nworkers <= 0 || config.queue_depth <= 0 || config.backlog <= 0
+      || config.cache_shards <= 0 || config.upstream_idle_max < 0 || config.upstream_idle <= 0
+      || config.client_idle < 0 || config.dns_ttl < 0 || config.dns_neg_ttl < 0
+      || config.connect_timeout <= 0 || config.header_timeout <= 0 || config.first_byte_timeout <= 0
+      || config.read_timeout <= 0 || config.write_timeout <= 0 || config.default_ttl < 0
+      || config.stale_grace < 0 || config.neg_ttl_4xx < 0 || config.neg_ttl_5xx < 0
+      || config.neg_connect_ttl < 0
+      || config.object_size > config.cache_size / config.cache_shards)
+    usage(argv[0]);  // every shard has to be able to hold the largest object
 
-  if (argc != 2) {
-    // fprintf: 출력을 파일에다 씀. strerr: 파일 포인터
-    fprintf(stderr, "usage: %s <port> \n", argv[0]);
-    exit(1);  // exit(1): 에러 시 강제 종료
+  if (config.snapshot_path) {
+    // blocked before any thread starts, so only snapshot_thread() takes them
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR2);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
   }
+  cache_init();
+  upstream_init();
+  refresh_init();
+  metrics_init();
+  log_init();
+  if (config.snapshot_path)
+    Pthread_create(&tid, NULL, snapshot_thread, &sigs);
+
   Signal(SIGPIPE, SIG_IGN);
   // 특정 클라이언트가 종료되어있다고 해서 남은 클라이언트가에 영향가지않게 그 한쪽 종료됐다는 시그널을 무시해라.
-  listenfd = Open_listenfd(argv[1]);
+  listenfd = Open_listenfd_backlog(argv[optind], config.backlog);
+
+  if (config.mode == MODE_EPOLL) {
+    if (config.nloops <= 0)
+      config.nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    event_run(listenfd, config.nloops);  // never returns
+  }
+
+  if (config.mode == MODE_POOL) {
+    // prethreaded: workers live for the whole run and take connfds from sbuf
+    sbuf_init(&sbuf, config.queue_depth);
+    for (i = 0; i < config.nworkers; i++)
+      Pthread_create(&tid, NULL, worker, NULL);
+  }
+
+  // the listening socket is drained in batches, see accept_batch()
+  if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) < 0)
+    unix_error("fcntl error");
   while (1) {
-    clientlen = sizeof(clientaddr);
+    n = accept_batch(listenfd, fds, ACCEPT_BATCH);
+    for (i = 0; i < n; i++) {
+      connfd = fds[i];
+      if (config.mode == MODE_POOL) {
+        if (config.overload == OVERLOAD_BLOCK) {
+          sbuf_insert(&sbuf, connfd);  // waits for a free slot, so accept stalls too
+        } else if (sbuf_tryinsert(&sbuf, connfd) < 0) {
+          clienterror(connfd, "", "503", "Service Unavailable", "Proxy is overloaded, try again later");
+          Close(connfd);
+        }
+        continue;
+      }
+
+      // 첫 번째 인자 *thread: 쓰레드 식별자
+      // 두 번째: 쓰레드 특성 지정 (기본: NULL)
+      // 세 번째: 쓰레드 함수
+      // 네 번째: 쓰레드 함수의 매개변수
+      // connfd는 포인터 크기에 들어가므로 값 자체를 인자로 넘긴다 (Malloc/Free 불필요)
+      Pthread_create(&tid, NULL, thread, (void *)(intptr_t)connfd);
+    }
+  }
+  return 0;
+}
 
-    /* pthread_create의 경우 argp 인자가 void* 이다. 
-    따라서 연결 식별자를 인자로 넣어줄 수 있게 안전하게 포인터를 만들어준다. */
-    connfdp = Malloc(sizeof(int));
-    *connfdp = Accept(listenfd,(SA *)&clientaddr,&clientlen); // 포인터가 가리키는 값을 연결 식별자 값으로.
+/*
+ * accept_batch - take up to max connections off the non-blocking listenfd
+ *     into fds, sleeping in poll() until there is at least one.  Peer
+ *     addresses are never asked for, let alone looked up.  The
+ *     connections stay blocking: doit() relies on socket deadlines, not
+ *     on readiness.  Returns the count.
+ */
+static int accept_batch(int listenfd, int *fds, int max) {
+  struct pollfd pfd = { .fd = listenfd, .events = POLLIN };
+  int n = 0, fd;
 
-    Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-    printf("Accepted connection from (%s %s).\n", hostname, port);
+  while (n < max) {
+    if ((fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+      fds[n++] = fd;
+      continue;
+    }
+    if (n > 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EMFILE || errno == ENFILE))
+      break;  // serve these first
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      poll(&pfd, 1, -1);
+    } else if (errno == EMFILE || errno == ENFILE) {
+      fprintf(stderr, "accept error: %s\n", strerror(errno));
+      poll(NULL, 0, ACCEPT_BACKOFF);  // out of descriptors until some connections close
+    }
+    // anything else (EINTR, a client that reset while queued): try the next one
+  }
+  return n;
+}
 
-    // 첫 번째 인자 *thread: 쓰레드 식별자
-    // 두 번째: 쓰레드 특성 지정 (기본: NULL)
-    // 세 번째: 쓰레드 함수
-    // 네 번째: 쓰레드 함수의 매개변수
-    Pthread_create(&tid, NULL, thread, connfdp);
+void usage(char *prog) {
+  // fprintf: 출력을 파일에다 씀. strerr: 파일 포인터
+  fprintf(stderr, "usage: %s [-m thread|pool|epoll] [-n loops] [-w workers] [-q depth] [-o block|503] [-b backlog]\n"
+                  "       [-C cache_bytes] [-O object_bytes] [-s shards] [-A tinylfu|all]\n"
+                  "       [-u idle_conns_per_host] [-U idle_secs] [-k client_idle_secs] [-T dns_ttl] [-N dns_neg_ttl]\n"
+                  "       [-c connect_ms] [-H header_secs] [-F first_byte_secs] [-R read_secs]\n"
+                  "       [-W write_secs] [-D disk_cache_file] [-Z disk_bytes] [-S snapshot_file]\n"
+                  "       [-E default_ttl] [-G stale_grace_secs] [-x 4xx|5xx|connect=secs]\n"
+                  "       [-M metrics_port] [-L access_log] <port>\n", prog);
+  exit(1);  // exit(1): 에러 시 강제 종료
+}
 
-    // doit(connfd);
+// byte count with an optional k, m or g suffix
+size_t parse_size(char *s) {
+  char *end;
+  size_t n = strtoul(s, &end, 10);
 
-    // Close(connfd);
+  switch (tolower((unsigned char)*end)) {
+  case 'g': n <<= 10;  // fall through
+  case 'm': n <<= 10;  // fall through
+  case 'k': n <<= 10;
   }
-  return 0;
+  return n;
 }
 
 void* thread(void *vargp){
-    int connfd = *((int*)vargp);
+    int connfd = (int)(intptr_t)vargp;
     Pthread_detach(pthread_self());  // 자기 자신을 분리해준다.
     // 각각의 연결이 별도의 쓰레드에 의해서 독립적으로 처리 -> 서버가 명시적으로 각각의 피어 쓰레드 종료하는 것 불필요 -> detach
     // 메모리 누수를 방지하기 위해서 사용
-    Free(vargp);  // 동적 할당한 파일 식별자 포인터를 free해준다.
     doit(connfd); // 클라이언트 요청을 파싱
     Close(connfd);
     return NULL;
 }
 
-void doit(int connfd) {
-  int end_serverfd;
+/* Save the cache on SIGUSR2, and on SIGTERM or SIGINT before exiting */
+void *snapshot_thread(void *vargp) {
+  sigset_t *sigs = vargp;
+  int sig;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    if (sigwait(sigs, &sig) != 0)
+      continue;
+    if (cache_snapshot() < 0)
+      fprintf(stderr, "cache snapshot to %s failed: %s\n", config.snapshot_path, strerror(errno));
+    if (sig != SIGUSR2)
+      exit(0);
+  }
+  return NULL;
+}
 
-  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-  char endserver_http_header[MAXLINE];
-  char hostname[MAXLINE], path[MAXLINE];
-  int port;
-  
-  // rio: client's rio / server_rio: endserver's rio
-  rio_t rio, server_rio;
+void *worker(void *vargp) {
+  Pthread_detach(pthread_self());
+  while (1) {
+    int connfd = sbuf_remove(&sbuf);  // blocks until accept hands us a connection
+    doit(connfd);
+    Close(connfd);
+  }
+  return NULL;
+}
 
+/*
+ * doit - serve requests on connfd until the client closes it, asks for it
+ *     to be closed, or leaves it idle for config.client_idle seconds.
+ *     Pipelined requests are read from rio's buffer in turn, so responses
+ *     go out in request order.
+ *
+ *     Every blocking call has a deadline (SO_RCVTIMEO/SO_SNDTIMEO, which
+ *     the kernel keeps per socket), so a stuck client or end server costs
+ *     this thread a timeout rather than the rest of its life.
+ */
+void doit(int connfd) {
+  // rio: client's rio, kept across requests so pipelined bytes aren't lost
+  rio_t rio;
+
+  stats_add(STAT_CONNS_OPENED, 1);
   Rio_readinitb(&rio, connfd);
-  Rio_readlineb(&rio, buf, MAXLINE);
-  sscanf(buf, "%s %s %s", method, uri, version);  // read the client reqeust line
+  sock_timeout(connfd, SO_SNDTIMEO, config.write_timeout);
+  while (serve_request(connfd, &rio) > 0)
+    ;
+  stats_add(STAT_CONNS_CLOSED, 1);
+}
 
-  if (strcasecmp(method, "GET")) {
-    printf("Proxy does not implement the method");
-    return;
+/* Serve one request; returns 1 if the connection can carry another */
+static int serve_request(int connfd, rio_t *rio) {
+  access_rec rec;
+  http_req q;
+  char *head;
+  int rc;
+
+  rec.start = 0;
+  switch (rc = read_request(rio, &q, &rec)) {
+  case 408:
+    clienterror(connfd, "", "408", "Request Timeout", "The request headers took too long");
+    break;
+  case 400:
+    clienterror(connfd, "", "400", "Bad Request", "The proxy could not parse the request");
+    break;
+  case 431:
+    clienterror(connfd, "", "431", "Request Header Fields Too Large", "The request head is too long");
+    break;
+  }
+  if (rc != 1) {
+    rec.status = rc > 1 ? rc : 0;
+    log_request(&rec);
+    return 0;
+  }
+  // the head is parsed where it lies; the next request starts after it
+  head = rio->rio_bufptr;
+  rio->rio_bufptr += q.head_len;
+  rio->rio_cnt -= q.head_len;
+  rc = handle_request(connfd, head, &q, &rec);
+  log_request(&rec);
+  return rc;
+}
+
+/*
+ * read_request - read the next request head into rio's buffer, parsing it
+ *     into q as it arrives; it is left in place at rio->rio_bufptr.  A
+ *     quiet client has config.client_idle, and once a request has started
+ *     its head has config.header_timeout, however it trickles in; rec
+ *     starts then too.  Returns 1 once the head is in, 0 if the client
+ *     closed or stayed quiet, the status to answer with for a head that
+ *     took too long (408), didn't parse (400) or didn't fit (431), or -1 if
+ *     the client went away part way through.
+ */
+static int read_request(rio_t *rp, http_req *q, access_rec *rec) {
+  long long deadline = 0, left;
+  ssize_t n;
+  int rc;
+
+  // a quiet client's read fails with EAGAIN
+  sock_timeout(rp->rio_fd, SO_RCVTIMEO, config.client_idle > 0 ? config.client_idle : config.header_timeout);
+  req_init(q);
+  while ((rc = req_feed(q, rp->rio_bufptr, rp->rio_cnt)) == 0) {
+    if (rec->start == 0 && (size_t)rp->rio_cnt > q->start) {
+      log_start(rec);
+      stats_add(STAT_REQUESTS, 1);
+      deadline = now_ms() + config.header_timeout * 1000LL;
+    }
+    if (rec->start != 0) {
+      // each read gets only what is left, so trickled bytes don't extend it
+      if ((left = deadline - now_ms()) <= 0)
+        return 408;
+      sock_timeout_ms(rp->rio_fd, SO_RCVTIMEO, left);
+    }
+    // more of it goes after what is there, at the front of the buffer
+    if (rp->rio_bufptr != rp->rio_buf) {
+      memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+      rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == sizeof(rp->rio_buf))
+      return 431;
+    if ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt)) < 0
+        && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (rec->start == 0)
+        return 0;  // closed, idle too long, or reset
+      return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 408 : -1;
+    }
+    rp->rio_cnt += n;
+  }
+  if (rec->start == 0) {  // it was all in the buffer already
+    log_start(rec);
+    stats_add(STAT_REQUESTS, 1);
   }
-  
-  char url_store[100];
-  strcpy(url_store, uri);   //doit으로 받아온 connfd가 들고 있는 uri를 넣어준다
-                            //uri는 path를 생각하면될까?
+  return rc < 0 ? 400 : 1;
+}
+
+/* The request whose head q is parsed from, timed and logged in rec; returns like serve_request() */
+static int handle_request(int connfd, char *head, http_req *q, access_rec *rec) {
+  char revalidate[MAXLINE], stem[MAXBUF + 64], hostname[MAXLINE], host_line[MAXLINE];
+  char *url = head + q->uri.off;  // NUL-terminated in place by req_feed()
+  struct iovec req[REQ_IOV];
+  int port = q->port, fd, keepalive, rc, leader, fresh, status, reqcnt, solo = 0;
+  long long t;
+  size_t n = 0;
+  upstream *u;
+  flight *f;
+  cache_block *block;
+
+  log_url(rec, head + q->method.off, url);
+  if (strcasecmp(head + q->method.off, "GET"))
+    return 0;  // not implemented; logged with no status
 
+  keepalive = q->keepalive && config.client_idle > 0;
+  req_host(q, head, hostname);
+  stats_time(rec, PH_HEADER, now_us() - rec->start);
+
+ lookup:
   // the url is cached?
-  int cache_index;
   // in cache then return the cache content
-  // cache_index 정수 선언, url_store에 있는 uri에 대한 캐시 인덱스를 뒤짐(cache_find:10개의 캐시블럭) 탐색 후 인덱스가 -1이 아니면
-  if ((cache_index=cache_find(url_store)) != -1) {
-    readerPre(cache_index); // 캐시 뮤텍스를 풀어줌(0->1)
-    // 캐시에서 찾은 값은 connfd에 쓰고, 캐시에서 그 값을 바로 보내게 됨
-    Rio_writen(connfd, cache.cacheobjs[cache_index].cache_obj, strlen(cache.cacheobjs[cache_index].cache_obj));
-    readerAfter(cache_index); // 닫아줌 1->0 doit 끝
-    return;
+  // url에 대한 캐시 블럭을 해시 인덱스에서 찾음 NULL이 아니면 hit
+  t = now_us();
+  block = cache_find(url);
+  stats_time(rec, PH_LOOKUP, now_us() - t);
+  if (block != NULL) { // hit이면 블럭의 reference를 하나 잡은 채로 돌아옴 (lock은 안 잡음)
+    if (!(fresh = cache_fresh(block, 0))) {
+      // stale, but within its grace: served now and refreshed in the background
+      cache_stem(block, stem);
+      if ((fresh = cache_fresh(block, stale_grace(stem))))
+        refresh_start(url, block);
+      rec->outcome = LOG_STALE;
+    } else
+      rec->outcome = LOG_HIT;
+    if (fresh) {
+      // 캐시에서 찾은 값은 connfd에 쓰고, 캐시에서 그 값을 바로 보내게 됨 (복사 없이)
+      // 클라이언트가 먼저 끊어도 프록시 전체가 죽지 않게 send_object는 에러만 돌려줌
+      rc = send_object(connfd, block, keepalive, rec);
+      if (!solo)
+        stats_add(STAT_HITS, 1);  // else counted as a miss already
+      if (rc == 0)
+        stats_add(STAT_BYTES_CACHE, block->obj_len);
+      cache_put(block); // reference 반납
+      stats_time(rec, PH_TOTAL, now_us() - rec->start);
+      return rc == 0 && keepalive;
+    }
+    // too stale: keep it to revalidate with its validators, or fetch it again if it has none
+    if ((n = cond_headers(stem, revalidate)) == 0) {
+      cache_put(block);
+      block = NULL;
+    }
+  }
+  if (!solo)
+    stats_add(STAT_MISSES, 1);
+  rec->outcome = LOG_MISS;
+  // the end server failed to connect a moment ago: don't wait on it again
+  if ((status = upstream_down(hostname, port)) != 0) {
+    gateway_error(connfd, hostname, status);
+    rec->status = status;
+    rec->outcome = LOG_NEGATIVE;
+    if (block)
+      cache_put(block);
+    return 0;
+  }
+  // 캐시에 없는 경우: 같은 url을 이미 가져오는 중이면 거기에 붙는다
+  // a response to a request with credentials is for that client alone
+  leader = 1;
+  f = (solo || q->auth) ? flight_solo(url) : flight_join(url, &leader);
+  if (q->auth)
+    tee_drop(&f->tee);
+  if (!leader) {
+    if (block)
+      cache_put(block);  // the leader revalidates it
+    rec->outcome = LOG_COLLAPSED;
+    rc = follow_flight(connfd, f, q->http11, &keepalive, rec);
+    flight_put(f);
+    if (rc == 0)
+      stats_time(rec, PH_TOTAL, now_us() - rec->start);
+    if (rc != 1)
+      return rc == 0 && keepalive;
+    // the flight failed before anything was sent: it may have landed in
+    // the cache after all, else fetch it ourselves
+    solo = 1;
+    goto lookup;
   }
-  // 캐시에 없는 경우
-  // parse the uri to get hostname, file path, port
-  parse_uri(uri, hostname, path, &port);
-
-  // build the http header which will send to the end server
-  build_http_header(endserver_http_header, hostname, path, port, &rio);
 
-  // connect to the end server
-  end_serverfd = connect_endServer(hostname, port, endserver_http_header);
-  if (end_serverfd < 0) {
-    printf("connection failed\n");
-    return;
+  // connect to the end server, reusing an idle connection if one is pooled
+  errno = 0;
+  t = now_us();
+  u = upstream_get(hostname, port);
+  stats_time(rec, PH_CONNECT, now_us() - t);
+  if (u == NULL) {
+    status = errno == ETIMEDOUT ? 504 : 502;
+    upstream_failed(hostname, port, status);
+    gateway_error(connfd, hostname, status);
+    rec->status = status;
+    flight_land(f, 0);
+    flight_put(f);
+    if (block)
+      cache_put(block);
+    return 0;
+  }
+  // straight out of the client's head, plus the conditional headers if revalidating
+  reqcnt = request_iov(q, head, req, host_line, revalidate, block ? n : 0);
+  rc = forward_request(connfd, u, req, reqcnt, f, block, q->http11, &keepalive, rec);
+  if (rc == 1) {
+    // the end server closed the pooled connection just before we used it:
+    // nothing has reached the client yet, so try once more on a new one
+    errno = 0;
+    if ((fd = upstream_connect(hostname, port)) < 0) {
+      status = errno == ETIMEDOUT ? 504 : 502;
+      upstream_failed(hostname, port, status);
+      gateway_error(connfd, hostname, status);
+      rec->status = status;
+    } else
+      rc = forward_request(connfd, upstream_new(fd, hostname, port), req, reqcnt, f, block,
+                           q->http11, &keepalive, rec);
+  }
+  if (rc == 2) {
+    // connected, but it took no request: as good as not reachable
+    upstream_failed(hostname, port, 502);
+    gateway_error(connfd, hostname, 502);
+    rec->status = 502;
+    rc = -1;
   }
+  flight_land(f, rc == 0);
+  flight_put(f);
+  if (block)
+    cache_put(block);
+  if (rc == 0)
+    stats_time(rec, PH_TOTAL, now_us() - rec->start);
+  return rc == 0 && keepalive;
+}
 
-  Rio_readinitb(&server_rio, end_serverfd);
+/*
+ * follow_flight - relay the response another request is fetching for the
+ *     same url.  Returns 0 or -1 like forward_request(), or 1 if the
+ *     flight failed before anything was sent to the client.
+ */
+static int follow_flight(int connfd, flight *f, int http11, int *keepalive, access_rec *rec) {
+  char buf[MAXBUF + 64], chunk[32];
+  size_t off, stem_len, head_len;
+  long long clen;
+  ssize_t n;
+  struct iovec iov[3];
+  int chunked = 0;
 
-  // write the http header to endserver
-  Rio_writen(end_serverfd, endserver_http_header, strlen(endserver_http_header));
+  if (flight_wait_head(f, &stem_len, &clen) < 0)
+    return 1;
+  for (off = 0; off < stem_len; off += n) {
+    if ((n = flight_read(f, off, buf + off, stem_len - off)) <= 0)
+      return 1;
+  }
 
-  // recieve message from end server and send to the client
-  char cachebuf[MAX_OBJECT_SIZE];
-  int sizebuf = 0;
-  size_t n; // 캐시에 없을 때 찾아주는 과정?
-  while ((n=Rio_readlineb(&server_rio, buf, MAXLINE)) != 0) {
-    // printf("proxy received %ld bytes, then send\n", n);
-    sizebuf += n;
-    // proxy 거쳐서 서버에서 response가 오는데, 그 응답을 저장하고 클라이언트에 보냄
-    if (sizebuf < MAX_OBJECT_SIZE)  //작으면 response 내용을 적어 놓는다.
-      strcat(cachebuf, buf);        // cachebuf에 buf(response값) 다 이어 붙혀 놓음(캐시내용)
-    Rio_writen(connfd, buf, n);
+  // same framing rules as forward_request()
+  if (clen < 0) {
+    if (http11)
+      chunked = *keepalive;
+    else
+      *keepalive = 0;
   }
-  Close(end_serverfd);
+  head_len = stem_len + client_head_end(buf + stem_len, chunked, *keepalive);
+  rec->status = head_status(buf);
+  if (rio_writen(connfd, buf, head_len) < 0)
+    return -1;
+  rec->bytes += head_len;
 
-  // store it
-  if (sizebuf < MAX_OBJECT_SIZE) {
-    cache_uri(url_store, cachebuf);
+  while ((n = flight_read(f, off, buf, MAXBUF)) > 0) {
+    off += n;
+    iov[0].iov_base = chunk;
+    iov[0].iov_len = chunked ? sprintf(chunk, "%zx\r\n", (size_t)n) : 0;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = n;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = chunked ? 2 : 0;
+    if (writev_all(connfd, iov, 3) < 0)
+      return -1;
+    rec->bytes += iov[0].iov_len + n + iov[2].iov_len;
   }
+  if (n < 0)
+    return -1;  // cut off: the response outgrew the flight
+  if (chunked && rio_writen(connfd, "0\r\n\r\n", 5) < 0)
+    *keepalive = 0;
+  return 0;
 }
 
-void build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio) {
-  char buf[MAXLINE], request_hdr[MAXLINE], other_hdr[MAXLINE], host_hdr[MAXLINE];
-  
-  // request line
-  sprintf(request_hdr, requestline_hdr_format, path);
-
-  // get other request header for client rio and change it
-  while (Rio_readlineb(client_rio, buf, MAXLINE) > 0) {
-    if (strcmp(buf, endof_hdr) == 0)
-      break;  // EOF
-    
-    if (!strncasecmp(buf, host_key, strlen(host_key))) {
-      strcpy(host_hdr, buf);
+/*
+ * forward_request - send the request in req (reqcnt pieces, see
+ *     request_iov()) to the end server on u and relay its response to
+ *     connfd, feeding it to the flight f for any followers and caching it
+ *     if it fits.  u is parked or closed before returning.  Returns 0 if
+ *     the response was relayed, -1 on error, 1 if u came from the pool and
+ *     failed before any response byte arrived (safe to retry on another
+ *     connection), and 2 if u was new and the request could not be
+ *     written to it.
+ *
+ *     If the client goes away part way through, the rest of the response
+ *     is still read into the flight as long as it is being kept, so its
+ *     followers and the cache get all of it; then 0 is returned with
+ *     *keepalive cleared.
+ *
+ *     The request may be a revalidation of the cached object stale: a 304
+ *     makes it fresh again and it is sent instead, and the flight gets no
+ *     head, so its followers look it up again.
+ *
+ *     *keepalive says whether the client connection is to stay open.  A
+ *     body of unknown length is chunked for an HTTP/1.1 client (http11);
+ *     an HTTP/1.0 client only learns where it ends when we close, so
+ *     *keepalive is cleared.
+ */
+static int forward_request(int connfd, upstream *u, struct iovec *req, int reqcnt, flight *f,
+                           cache_block *stale, int http11, int *keepalive, access_rec *rec) {
+  char buf[MAXBUF], stem[MAXBUF + 64], chunk[32];
+  size_t body, stem_len = 0, head_len;
+  ssize_t n, used;
+  http_resp resp;
+  struct iovec iov[3];
+  int sent_head = 0, reusable = 0, chunked = 0, gone = 0;
+  long long sent;
+
+  // the end server has config.first_byte_timeout to take the request and start answering
+  sock_timeout(u->fd, SO_SNDTIMEO, config.first_byte_timeout);
+  sock_timeout(u->fd, SO_RCVTIMEO, config.first_byte_timeout);
+
+  // the whole request in one writev()
+  if (writev_all(u->fd, req, reqcnt) < 0) {
+    n = u->reused ? 1 : 2;
+    upstream_put(u, 0);
+    return n;
+  }
+  sent = now_us();
+
+  resp_init(&resp);
+  // recieve message from end server and send to the client
+  while (resp.state != RESP_DONE) {
+    if ((n = read(u->fd, buf, sizeof(buf))) < 0 && errno == EINTR)
       continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!sent_head) {
+        clienterror(connfd, "", "504", "Gateway Timeout", "The end server did not answer in time");
+        rec->status = 504;
+      }
+      goto fail;
     }
+    if (n <= 0) {
+      if (resp.head_len == 0 && u->reused) {
+        upstream_put(u, 0);
+        return 1;
+      }
+      if (resp.head_len == 0) {  // closed or reset without a word: still answer the client
+        gateway_error(connfd, u->key, 502);
+        rec->status = 502;
+        goto fail;
+      }
+      if (n < 0 || resp_eof(&resp) < 0)
+        goto fail;  // cut off mid-response
+      break;
+    }
+    if (resp.head_len == 0 && config.read_timeout != config.first_byte_timeout)
+      sock_timeout(u->fd, SO_RCVTIMEO, config.read_timeout);  // it has started
+    stats_add(STAT_BYTES_ORIGIN, n);
+    if ((used = resp_feed(&resp, buf, n, &body)) < 0)
+      goto fail;
 
-    if (!strncasecmp(buf, connection_key, strlen(connection_key))
-      && !strncasecmp(buf, proxy_connection_key, strlen(proxy_connection_key))
-      && !strncasecmp(buf, user_agent_key, strlen(user_agent_key))) {
-        strcat(other_hdr, buf);
+    if (!sent_head && resp.state != RESP_HEAD) {
+      stats_time(rec, PH_FIRST_BYTE, now_us() - sent);
+      if (stale && resp.status == 304) {
+        // still good: fresh again, and it is what the client gets
+        cache_stem(stale, stem);
+        cache_refresh(stale, resp_refresh(&resp, stem));
+        upstream_put(u, resp.keepalive && used == n);
+        rec->outcome = LOG_REVALIDATED;
+        return send_object(connfd, stale, *keepalive, rec);
       }
+      // not for the cache, so followers fetch it themselves; nor is an
+      // error when we have a stale copy, which stays
+      if (resp.expires < 0 || (stale && resp.status >= 500))
+        tee_drop(&f->tee);
+      // the end server's head, minus its hop-by-hop headers, then our own
+      stem_len = resp_stem(&resp, stem);
+      flight_head(f, stem, stem_len, resp.clen);
+      if (resp.clen < 0) {
+        if (http11)
+          chunked = *keepalive;
+        else
+          *keepalive = 0;
+      }
+      head_len = stem_len + client_head_end(stem + stem_len, chunked, *keepalive);
+      rec->status = resp.status;
+      if (rio_writen(connfd, stem, head_len) < 0)
+        gone = 1;
+      else
+        rec->bytes += head_len;
+      sent_head = 1;
+    }
+    if (body > 0) {
+      // proxy 거쳐서 서버에서 response가 오는데, 그 응답을 저장하고 클라이언트에 보냄
+      flight_body(f, buf, body);  // object size 한도 안이면 response 내용을 적어 놓는다.
+      iov[0].iov_base = chunk;
+      iov[0].iov_len = chunked ? sprintf(chunk, "%zx\r\n", body) : 0;
+      iov[1].iov_base = buf;
+      iov[1].iov_len = body;
+      iov[2].iov_base = "\r\n";
+      iov[2].iov_len = chunked ? 2 : 0;
+      if (!gone && writev_all(connfd, iov, 3) < 0)
+        gone = 1;
+      else if (!gone)
+        rec->bytes += iov[0].iov_len + body + iov[2].iov_len;
+    }
+    if (gone) {
+      // the client hung up or stopped reading: finish the fetch for the
+      // followers and the cache, unless neither is getting a copy
+      *keepalive = 0;
+      if (f->tee.toobig)
+        goto fail;
+    }
+    // too big to cache and framed the same on both sides: the rest of the
+    // body doesn't need to pass through our buffers at all
+    if (f->tee.toobig && !chunked && (resp.state == RESP_BODY || resp.state == RESP_EOF)) {
+      if (splice_body(u->fd, connfd, &resp, &rec->bytes) < 0)
+        goto fail;
+    }
+    // bytes past the end of the response: the connection is out of step
+    reusable = resp.keepalive && used == n;
   }
-  if (strlen(host_hdr) == 0) {
-    sprintf(host_hdr, host_hdr_format, hostname);
-  }
-  sprintf(http_header, "%s%s%s%s%s%s%s",
-          request_hdr,
-          host_hdr,
-          conn_hdr,
-          prox_hdr,
-          user_agent_hdr,
-          other_hdr,
-          endof_hdr);
-  return;
-}
+  upstream_put(u, resp.state == RESP_DONE && reusable);
+  if (chunked && (gone || rio_writen(connfd, "0\r\n\r\n", 5) < 0))
+    *keepalive = 0;
+  else if (chunked)
+    rec->bytes += 5;
+
+  // store it, before the flight lands so later misses find it
+  if (f->tee.buf != NULL)
+    cache_response(f->url, &f->tee, &resp, stem_len);
+  return 0;
 
-// Connect to the end server
-inline int connect_endServer(char *hostname, int port, char *http_header) {
-  char portStr[100];
-  sprintf(portStr, "%d", port);
-  return Open_clientfd(hostname, portStr);
+ fail:
+  upstream_put(u, 0);
+  return -1;
 }
 
-// parse the uri to get hostname, file path, port
-void parse_uri(char *uri, char *hostname, char *path, int *port) {
-  *port = 80;
-  char *pos = strstr(uri, "//");
+/*
+ * splice_body - relay the rest of r's body from fromfd to tofd through a
+ *     pipe with splice(), so it is never copied into user space.  A
+ *     Content-Length body stops after r->left bytes, any other at end of
+ *     connection.  The bytes moved are added to *moved.  Returns 0 with r
+ *     done, or -1 on error.
+ */
+int splice_body(int fromfd, int tofd, http_resp *r, size_t *moved) {
+  int p[2], rc = -1;
+  ssize_t n, m;
+  size_t want;
 
-  pos = pos!=NULL? pos+2:uri;
+  if (pipe2(p, O_CLOEXEC) < 0)
+    return -1;
+  fcntl(p[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);  // fewer round trips; fine if refused
 
-  char *pos2 = strstr(pos, ":");
-  // sscanf(pos, "%s", hostname);
-  if (pos2 != NULL) {
-    *pos2 = '\0';
-    sscanf(pos, "%s", hostname);
-    sscanf(pos2+1, "%d%s", port, path);
-  } else {
-    pos2 = strstr(pos, "/");
-    if (pos2 != NULL) {
-      *pos2 = '\0';  // 중간에 끊으려고
-      sscanf(pos, "%s", hostname);
-      *pos2 = '/';
-      sscanf(pos2, "%s", path);
-    } else {
-      scanf(pos, "%s", hostname);
+  while (1) {
+    want = SPLICE_PIPE_SIZE;
+    if (r->state == RESP_BODY && (long long)want > r->left)
+      want = r->left;
+    if ((n = splice(fromfd, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (n == 0) {  // end server closed
+      rc = resp_eof(r);
+      break;
+    }
+    while (n > 0) {
+      if ((m = splice(p[0], NULL, tofd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+        if (errno == EINTR)
+          continue;
+        goto out;
+      }
+      n -= m;
+      *moved += m;
+      stats_add(STAT_BYTES_ORIGIN, m);
+      if (r->state == RESP_BODY)
+        r->left -= m;
+    }
+    if (r->state == RESP_BODY && r->left == 0) {
+      r->state = RESP_DONE;
+      rc = 0;
+      break;
     }
   }
-  return;
+ out:
+  close(p[0]);
+  close(p[1]);
+  return rc;
 }
 
-void cache_init() {
-  cache.cache_num = 0;  //맨 처음이니까
-  int i;
-  for (i=0; i<CACHE_OBJS_COUNT; i++) {
-    cache.cacheobjs[i].LRU = 0; // LRU : 우선 순위를 미는 것. 처음이니까 0
-    cache.cacheobjs[i].isEmpty = 1; // 1이 비어있다는 뜻
-
-    // Sem_init : 세마포어 함수
-    // Sem_init 첫 번째 인자: 초기화할 세마포어의 포인터
-    // 두 번째: 0 - 쓰레드들끼리 세마포어 공유, 그 외 - 프로세스 간 공유
-    // 세 번째: 초기 값
-    // 뮤텍스 만들 포인터 / 0 : 세마포어를 뮤텍스로 쓰려면 0을 써야 쓰레드끼리 사용하는거라고 표시하는 것이 됨 / 1 : 초기값 
-    // 세마포어는 프로세스를 쓰는 것. 지금 세마포어를 쓰레드에 적용하고 싶으니까 0을 써서 쓰레드에서 쓰는거라고 표시, 나머지 숫자를 프로세스에서 쓰는거라는 표시.
-    Sem_init(&cache.cacheobjs[i].wmutex, 0, 1); // wmutex : 캐시에 접근하는 것을 프로텍트해주는 뮤텍스
-    Sem_init(&cache.cacheobjs[i].rdcntmutex, 0, 1); // read count mutex : 리드카운트에 접근하는 것을 프로텍트해주는 뮤텍스
-
-    cache.cacheobjs[i].readCnt = 0; // read count를 0으로 놓고 init를 끝냄
+/*
+ * cache_response - store a relayed response, the head in t ending after
+ *     stem_len bytes.  A body whose length was set by chunking or by the end
+ *     server closing gets a Content-Length, so hits are self-delimiting.
+ */
+void cache_response(char *url, cache_tee *t, http_resp *resp, size_t stem_len) {
+  char clen[64], *obj;
+  size_t n;
+
+  if (resp->expires < 0)
+    return;
+  if (resp->clen >= 0) {
+    cache_uri(url, t->buf, t->len, stem_len, resp->expires);
+    return;
   }
+  // t is left as it is: followers of a flight may still be reading it
+  n = sprintf(clen, "Content-Length: %zu\r\n", t->len - stem_len);
+  if (t->len + n > cache_object_max())
+    return;
+  obj = Malloc(t->len + n);
+  memcpy(obj, t->buf, stem_len);
+  memcpy(obj + stem_len, clen, n);
+  memcpy(obj + stem_len + n, t->buf + stem_len, t->len - stem_len);
+  cache_uri(url, obj, t->len + n, stem_len + n, resp->expires);
+  Free(obj);
 }
 
-void readerPre(int i) {// i = 해당인덱스
-  // 내가 받아온 index오브젝트의 리드카운트 뮤텍스를 P함수(recntmutex에 접근을 가능하게) 해준다
-  /* rdcntmutex로 특정 readcnt에 접근하고 +1해줌. 원래 0으로 세팅되어있어서, 누가 안쓰고 있으면 0이었다가 1로 되고 if문 들어감 */
-  P(&cache.cacheobjs[i].rdcntmutex); // P연산(locking):정상인지 검사, 기다림 (P함수 비정상이면 에러 도출되는 로직임)
-  cache.cacheobjs[i].readCnt++; // readCnt 풀고 들어감
-   /* 조건문 들어오면 그때서야 캐쉬에 접근 가능. 그래서 만약 누가 쓰고있어도 P, readCnt까지는 할 수 있는데 +1이 되니까 1->2가 되고 
-    그러면 캐시에 접근을 못하게 됨. but readerAfter에서 -1 다시 내려주기때문에 0, 1, 0 에서만 움직임 */
-  if (cache.cacheobjs[i].readCnt == 1)
-    P(&cache.cacheobjs[i].wmutex); // write mutex 뮤텍스를 풀고(캐시에 접근)
-  V(&cache.cacheobjs[i].rdcntmutex); // V연산 풀기(캐시 쫒아냄) / read count mutex
+/*
+ * client_head_end - the headers we add to a relayed head, and the blank
+ *     line that ends it.  Returns the length written to out.
+ */
+size_t client_head_end(char *out, int chunked, int keepalive) {
+  return sprintf(out, "%s%s", chunked ? "Transfer-Encoding: chunked\r\n" : "",
+                 keepalive ? CLIENT_KEEPALIVE_END : CLIENT_CLOSE_END);
 }
 
-void readerAfter(int i) {
-  P(&cache.cacheobjs[i].rdcntmutex);
-  cache.cacheobjs[i].readCnt--;
-  if (cache.cacheobjs[i].readCnt == 0)
-    V(&cache.cacheobjs[i].wmutex);
-  V(&cache.cacheobjs[i].rdcntmutex);
+/* A cached response goes out as its head, our Connection header, then the body */
+void object_iov(cache_block *b, struct iovec *iov, int keepalive) {
+  iov[0].iov_base = b->cache_obj;
+  iov[0].iov_len = b->head_len;
+  iov[1].iov_base = keepalive ? CLIENT_KEEPALIVE_END : CLIENT_CLOSE_END;
+  iov[1].iov_len = strlen(iov[1].iov_base);
+  iov[2].iov_base = b->cache_obj + b->head_len;
+  iov[2].iov_len = b->obj_len - b->head_len;
 }
 
-int cache_find(char *url) {
-  int i;
-  for (i = 0; i < CACHE_OBJS_COUNT; i++) {
-    readerPre(i);
-        //  인덱스 i에서 캐시가 비어 있지 않고    &&  내가 받아온 url과 캐시에 있는 url이 같은지 확인
-    if (cache.cacheobjs[i].isEmpty == 0 && strcmp(url, cache.cacheobjs[i].cache_url) == 0) {
-      readerAfter(i);
-      return i;
-    }
-    readerAfter(i);
-  }
-  return -1;
-}
+static int send_object(int fd, cache_block *b, int keepalive, access_rec *rec) {
+  struct iovec iov[3];
 
+  object_iov(b, iov, keepalive);
+  rec->status = head_status(b->cache_obj);
+  if (writev_all(fd, iov, 3) < 0)
+    return -1;
+  rec->bytes += b->obj_len + iov[1].iov_len;
+  return 0;
+}
 
+/*
+ * writev_at - one writev() of what is left of the bytes in iov after the
+ *     first off of them.  Returns what writev() returns.
+ */
+ssize_t writev_at(int fd, struct iovec *iov, int cnt, size_t off) {
+  struct iovec left[cnt];
+  int i, n = 0;
 
-int cache_eviction() {  // 캐시 쫓아내기
-  int min = LRU_MAGIC_NUMBER; // 초기 min = 9999 
-  int minindex = 0;           // 초기 minindex = 0
-  int i;                        
-  for (i=0; i<CACHE_OBJS_COUNT; i++) {  // i = 0 ~ 9까지 for문을 돌린다
-    readerPre(i);
-    if (cache.cacheobjs[i].isEmpty == 1) {  //비어 있으면 
-      minindex = i;                         //minindex를 i로 초기화한다 -> 여기에 넣으려고
-      readerAfter(i);
-      break;
-    }
-    if (cache.cacheobjs[i].LRU < min) {     // index의 LRU 값이 min보다 작으면
-      minindex = i;                         // minindex를 i로 초기화해주고
-      min = cache.cacheobjs[i].LRU;         // min값도 index의 LRU값으로 초기화해준다.
-      readerAfter(i);
+  for (i = 0; i < cnt; i++) {
+    if (off >= iov[i].iov_len) {
+      off -= iov[i].iov_len;
       continue;
     }
-    readerAfter(i);
+    left[n].iov_base = (char *)iov[i].iov_base + off;
+    left[n].iov_len = iov[i].iov_len - off;
+    off = 0;
+    n++;
   }
-  return minindex; // minindex를 리턴한다.
+  if (n == 0)
+    return 0;
+  return writev(fd, left, n);
 }
 
+/* Milliseconds on a clock that doesn't jump, for timeouts */
+long long now_ms() {
+  struct timespec ts;
 
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-void writePre(int i) {
-  P(&cache.cacheobjs[i].wmutex);
+/* Give blocking reads (SO_RCVTIMEO) or writes (SO_SNDTIMEO) on fd secs to complete */
+void sock_timeout(int fd, int opt, int secs) {
+  sock_timeout_ms(fd, opt, secs * 1000LL);
 }
 
-void writeAfter(int i) {
-  V(&cache.cacheobjs[i].wmutex);
+void sock_timeout_ms(int fd, int opt, long long ms) {
+  struct timeval tv = { ms / 1000, ms % 1000 * 1000 };
+
+  setsockopt(fd, SOL_SOCKET, opt, &tv, sizeof(tv));
 }
 
-// update the LRU number except the new cache one
-void cache_LRU(int index) {
+/* Write all the bytes in iov to a blocking fd, -1 on error */
+int writev_all(int fd, struct iovec *iov, int cnt) {
+  size_t off = 0, total = 0;
+  ssize_t n;
   int i;
-  for (i = 0; i < CACHE_OBJS_COUNT; i++) {
-    if (i == index) { continue; } // 새로들어온 index
-    writePre(i);
-    if (cache.cacheobjs[i].isEmpty == 0) {
-      cache.cacheobjs[i].LRU--;
+
+  for (i = 0; i < cnt; i++)
+    total += iov[i].iov_len;
+  while (off < total) {
+    if ((n = writev_at(fd, iov, cnt, off)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
     }
-    writeAfter(i);
+    off += n;
   }
+  return 0;
 }
 
-// cache the uri and content in cache
-void cache_uri(char *uri, char *buf) {
-  int i = cache_eviction(); // LRU로 교체해야할 minindex
-  
-  writePre(i);
+/*
+ * request_iov - the request for the end server, in iov pieces that point
+ *     into the client's head buf, parsed into q: the request line, Host
+ *     (built in host_line if the client sent none), our Connection and
+ *     User-Agent, the client's other end-to-end headers, the extra_len
+ *     bytes of extra (conditional headers) and the blank line.  Returns
+ *     the count, at most REQ_IOV.
+ */
+int request_iov(http_req *q, char *buf, struct iovec *iov, char *host_line, char *extra, size_t extra_len) {
+  int n = 0, i, len;
+
+#define PIECE(p, len) (iov[n].iov_base = (p), iov[n++].iov_len = (len))
+  if (q->path.len > 0 && buf[q->path.off] == '/')
+    PIECE("GET ", 4);
+  else  // empty, or only a query: http://host?x=1 asks for /?x=1, as cache_key() has it
+    PIECE("GET /", 5);
+  PIECE(buf + q->path.off, q->path.len);
+  PIECE(" HTTP/1.1\r\n", 11);
+  if (q->host_hdr.len > 0) {
+    PIECE(buf + q->host_hdr.off, q->host_hdr.len);
+  } else {
+    if (q->port == 80)
+      len = snprintf(host_line, MAXLINE, "Host: %.*s\r\n", (int)q->host.len, buf + q->host.off);
+    else
+      len = snprintf(host_line, MAXLINE, "Host: %.*s:%d\r\n", (int)q->host.len, buf + q->host.off, q->port);
+    PIECE(host_line, len < MAXLINE ? len : MAXLINE - 1);
+  }
+  PIECE((char *)conn_hdr, strlen(conn_hdr));
+  PIECE((char *)user_agent_hdr, strlen(user_agent_hdr));
+  for (i = 0; i < q->nhdrs; i++)
+    PIECE(buf + q->hdrs[i].off, q->hdrs[i].len);
+  PIECE(extra, extra_len);
+  PIECE("\r\n", 2);
+#undef PIECE
+  return n;
+}
 
-  strcpy(cache.cacheobjs[i].cache_obj, buf);
-  strcpy(cache.cacheobjs[i].cache_url, uri);
-  cache.cacheobjs[i].isEmpty = 0;
-  cache.cacheobjs[i].LRU = LRU_MAGIC_NUMBER; 
-  cache_LRU(i);
+// send an HTTP error response to the client (same layout as Tiny's)
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+  char buf[MAXLINE], body[MAXBUF];
 
-  writeAfter(i);
-}
\ No newline at end of file
+  // the client may already be gone, so write errors are ignored
+  snprintf(body, sizeof(body),
+           "<html><title>Proxy Error</title><body bgcolor=\"ffffff\">\r\n"
+           "%s: %s\r\n<p>%s: %s\r\n<hr><em>The Proxy</em>\r\n",
+           errnum, shortmsg, longmsg, cause);
+  snprintf(buf, sizeof(buf),
+           "HTTP/1.0 %s %s\r\nContent-type: text/html\r\nContent-length: %d\r\n\r\n",
+           errnum, shortmsg, (int)strlen(body));
+  if (rio_writen(fd, buf, strlen(buf)) < 0)
+    return;
+  rio_writen(fd, body, strlen(body));
+}
+
+/* Tell the client the end server can't be reached: 502, or 504 if it didn't answer in time */
+void gateway_error(int fd, char *hostname, int status) {
+  if (status == 504)
+    clienterror(fd, hostname, "504", "Gateway Timeout", "The end server did not accept in time");
+  else
+    clienterror(fd, hostname, "502", "Bad Gateway", "The end server could not be reached");
+}
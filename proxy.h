@@ -0,0 +1,429 @@
+/*
+ * proxy.h - definitions shared by the proxy's source files
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+#include <sys/uio.h>
+
+/* Recommended max cache and object sizes, the defaults for -C and -O */
+#define MAX_CACHE_SIZE 1024000
+#define MAX_OBJECT_SIZE 102400
+
+/* Proxy engines, selected with -m at startup */
+#define MODE_THREAD 0  /* one detached thread per connection (default) */
+#define MODE_EPOLL  1  /* fixed number of non-blocking epoll event loops */
+#define MODE_POOL   2  /* prethreaded workers fed through a bounded queue */
+
+/* What -m pool does when the connection queue is full (-o) */
+#define OVERLOAD_BLOCK 0  /* stop accepting until a slot frees up */
+#define OVERLOAD_503   1  /* answer 503 right away and close */
+
+/* Which new objects the cache takes in when it is full (-A) */
+#define ADMIT_TINYLFU 0  /* only ones more popular than what they would evict */
+#define ADMIT_ALL     1  /* every one: plain CLOCK, for comparison */
+
+/* Per-thread counters, see stats_add() */
+#define STAT_REQUESTS      0
+#define STAT_HITS          1
+#define STAT_MISSES        2
+#define STAT_BYTES_CACHE   3  /* response bytes sent from the cache */
+#define STAT_BYTES_ORIGIN  4  /* response bytes read from end servers */
+#define STAT_CONNS_OPENED  5  /* client connections */
+#define STAT_CONNS_CLOSED  6
+#define STAT_NCOUNTERS     7
+
+/* Request phases timed in latency histograms, see stats_time() */
+#define PH_HEADER      0  /* reading the client's headers */
+#define PH_LOOKUP      1  /* cache_find() */
+#define PH_CONNECT     2  /* getting an end server connection */
+#define PH_FIRST_BYTE  3  /* request sent to the end server's head in */
+#define PH_TOTAL       4  /* request line in to response out */
+#define PH_NPHASES     5
+
+/* What the proxy did for a request, in the access log (-L) */
+#define LOG_NONE        0  /* nothing came from the cache or an end server */
+#define LOG_HIT         1
+#define LOG_STALE       2  /* served stale within its grace, refresh queued */
+#define LOG_MISS        3
+#define LOG_REVALIDATED 4  /* stale copy confirmed by the end server's 304 */
+#define LOG_COLLAPSED   5  /* relayed from another request's fetch of the url */
+#define LOG_NEGATIVE    6  /* failed at once: the end server was unreachable a moment ago */
+
+#define LOG_RING     512  /* records a thread buffers before it drops them */
+#define LOG_FLUSH_MS 50   /* how often the log writer drains the rings */
+#define LOG_URL      256  /* url bytes kept in a record */
+
+#define CACHE_SHARDS 8  /* default -s */
+#define SKETCH_OBJ   256   /* bytes per counter in each row of the popularity sketch */
+
+#define NWORKERS    16  /* default -w */
+#define QUEUE_DEPTH 64  /* default -q */
+
+#define LISTEN_BACKLOG 1024  /* default -b: connections the kernel queues for accept (capped by somaxconn) */
+#define ACCEPT_BATCH   64    /* connections taken off the listen queue per wakeup */
+#define ACCEPT_BACKOFF 100   /* ms to stop accepting when out of descriptors */
+
+#define UPSTREAM_IDLE_MAX 8   /* default -u: idle connections kept per end server (open ones are not capped) */
+#define UPSTREAM_IDLE     30  /* default -U: seconds before an idle one is closed */
+#define CLIENT_IDLE   15  /* default -k: seconds a quiet client connection is kept */
+
+#define DNS_TTL     60  /* default -T: seconds a resolved name is kept */
+#define DNS_NEG_TTL 5   /* default -N: seconds a failed lookup is kept */
+#define DNS_RESOLVERS 4 /* threads resolving cache misses for the event loops */
+
+#define CONNECT_TIMEOUT 3000  /* default -c: ms to wait for an end server to accept */
+#define CONNECT_STAGGER 250   /* ms before racing the next address (happy eyeballs) */
+#define CONNECT_MAX_TRY 8     /* addresses raced per connect */
+
+/* Per-phase deadlines, in seconds (defaults for -H, -F, -R and -W) */
+#define HEADER_TIMEOUT     10  /* client request headers, from the request line on */
+#define FIRST_BYTE_TIMEOUT 30  /* end server's first response byte, once connected */
+#define READ_TIMEOUT       30  /* gap between end server bytes after that */
+#define WRITE_TIMEOUT      30  /* client not taking our writes */
+
+#define DEFAULT_TTL 300  /* default -E: seconds a response that says nothing about freshness stays fresh */
+#define STALE_GRACE 30   /* default -G: seconds a stale object is still served while it is refreshed */
+#define NEG_TTL_4XX     30  /* default -x 4xx=: seconds an error response is cached, */
+#define NEG_TTL_5XX     5   /* -x 5xx=: unless it says otherwise */
+#define NEG_TTL_CONNECT 5   /* -x connect=: seconds requests to an unreachable end server fail fast */
+#define REFRESH_WORKERS 2   /* threads refreshing stale objects in the background */
+#define REFRESH_QUEUE   256 /* refreshes waiting for them */
+
+#define DISK_SIZE    (1UL << 30)  /* default -Z: bytes of disk for the second cache tier */
+#define DISK_SEGMENT (8UL << 20)  /* unit the disk tier fills and reuses; caps its objects */
+#define DISK_QUEUE_BYTES (64UL << 20)  /* objects waiting for the disk writer before stores are dropped */
+
+#define SPLICE_PIPE_SIZE (256 * 1024)  /* pipe for splice() relays of uncacheable bodies */
+
+/* End the response head sent to a client, see client_head_end() */
+#define CLIENT_KEEPALIVE_END "Connection: keep-alive\r\n\r\n"
+#define CLIENT_CLOSE_END     "Connection: close\r\n\r\n"
+
+/* Runtime settings, filled in from the command line by main() */
+typedef struct {
+  int mode;         // MODE_*
+  int nloops;       // event loops for -m epoll (0: one per CPU)
+  int nworkers;     // worker threads for -m pool
+  int queue_depth;  // connection queue slots for -m pool
+  int overload;     // OVERLOAD_*
+  int backlog;      // listen() backlog
+  size_t cache_size;   // total cache budget in bytes
+  size_t object_size;  // largest object the cache stores
+  int cache_shards;    // independently locked slices of the cache
+  int admission;       // ADMIT_*
+  int upstream_idle_max;  // idle end server connections parked per host (0: none), not a cap on open ones
+  int upstream_idle;   // seconds an idle end server connection is kept
+  int client_idle;     // seconds a client connection may wait between requests (0: one request each)
+  int dns_ttl;         // seconds a resolved end server name is cached
+  int dns_neg_ttl;     // seconds a failed lookup is cached
+  int connect_timeout; // ms allowed for connecting to an end server
+  int header_timeout;  // seconds allowed for a client's request headers
+  int first_byte_timeout;  // seconds an end server may take to start answering
+  int read_timeout;    // seconds an end server may go quiet mid-response
+  int write_timeout;   // seconds a client may leave our writes blocked
+  char *disk_path;     // file for the on-disk cache tier (NULL: memory only)
+  char *snapshot_path; // where the memory tier is saved and restored from (NULL: nowhere)
+  int default_ttl;     // seconds of freshness for responses with no freshness or validators
+  int stale_grace;     // seconds past expiry a hit is served stale and refreshed in the background
+  int neg_ttl_4xx;     // seconds a 404, 405, 410 or 414 without freshness information is cached
+  int neg_ttl_5xx;     // same for a 500 to 504
+  int neg_connect_ttl; // seconds a failed connect to an end server fails its requests at once
+  char *metrics_port;  // admin port for the metrics page (NULL: none)
+  char *access_log;    // file the access log is appended to (NULL: none)
+  size_t disk_size;    // its size in bytes
+} proxy_config;
+
+extern proxy_config config;
+
+typedef struct disk_seg disk_seg;
+
+typedef struct cache_block
+{
+  char *cache_obj;          // object bytes (not NUL-terminated), allocated with the block
+  size_t obj_len;
+  size_t head_len;          // status line and headers, without the blank line
+  time_t expires;           // fresh until then, see cache_fresh()
+  char *cache_url;          // normalized url, see cache_key()
+  unsigned long hash;       // hash of cache_url
+  size_t size;              // bytes charged against config.cache_size
+  int ref;  // reference bit: set by hits, cleared by the clock hand
+  int refcnt;               // the cache's reference plus one per reader
+  disk_seg *disk;           // set for a disk hit: cache_obj points into the disk tier's map
+  int unchecked;            // restored from a snapshot, sum not verified yet
+  unsigned long sum;        // the object's checksum in the snapshot
+  struct cache_block *hnext;  // next block in the same hash bucket
+  struct cache_block *prev, *next;  // clock ring
+} cache_block;   //캐시 블럭 구조체로 선언
+
+
+/* One slice of the cache; aligned so neighbouring shards' locks don't share a cache line */
+typedef struct
+{
+  cache_block **buckets;   // hash index: normalized url -> block
+  unsigned nbuckets;       // power of two
+  cache_block *hand;       // clock hand: next block cache_victim() looks at
+  size_t size;             // bytes held, at most max_size
+  size_t max_size;         // this shard's slice of config.cache_size
+  unsigned nobjs;
+  unsigned char *sketch;   // count-min popularity sketch, SKETCH_ROWS rows
+  unsigned sketch_mask;    // counters per row, minus one (power of two)
+  unsigned sketch_adds;    // accesses recorded since the counters were last halved
+  unsigned long admit_rejects;
+  unsigned long evictions;
+  pthread_rwlock_t lock;   // protects the index and the ring
+} __attribute__((aligned(64))) cache_shard;
+
+typedef struct
+{
+  cache_shard *shards;
+  int nshards;
+} Cache;
+
+/* Copy of a response being relayed, kept for cache_uri() while it fits */
+typedef struct
+{
+  char *buf;
+  size_t len, cap;
+  int toobig;   // outgrew config.object_size, buf has been dropped
+} cache_tee;
+
+extern Cache cache;
+
+/* A cache miss being fetched, shared by every request for the url (flight.c) */
+typedef struct flight
+{
+  char *url;          // normalized, see cache_key()
+  unsigned long hash;
+  cache_tee tee;      // the response so far: stem, then body
+  size_t stem_len;    // 0 until the head has arrived
+  long long clen;     // the response's Content-Length, -1 if none
+  int done;           // 0 in the air, 1 landed, -1 failed
+  int listed;         // in the table, so others can join
+  int refcnt;
+  pthread_mutex_t lock;  // protects tee, stem_len, clen and done
+  pthread_cond_t cond;   // signalled as they change
+  struct flight *next;
+} flight;
+
+/* Where an http_resp is in the response (resp_feed) */
+#define RESP_HEAD       0  /* status line and headers */
+#define RESP_BODY       1  /* Content-Length body */
+#define RESP_EOF        2  /* body runs until the end server closes */
+#define RESP_CHUNK_SIZE 3  /* chunked body: size line */
+#define RESP_CHUNK      4  /* chunked body: chunk data */
+#define RESP_CHUNK_END  5  /* chunked body: CRLF after the data */
+#define RESP_TRAILER    6  /* chunked body: trailer lines */
+#define RESP_DONE       7  /* response complete */
+
+/* An end server's response as it is scanned */
+typedef struct
+{
+  int state;          // RESP_*
+  char head[MAXBUF];  // status line and headers, NUL-terminated once complete
+  size_t head_len;
+  int status;
+  int keepalive;      // end server will keep the connection open afterwards
+  int chunked;
+  long long clen;     // Content-Length, -1 if none
+  long long left;     // body or chunk bytes still to come
+  int line_len;       // chunk size / trailer line scanning
+  time_t expires;     // once the head is in: when it goes stale if cached, -1 if it mustn't be
+} http_resp;
+
+/* One request as the access log records it, filled in as it is served */
+typedef struct
+{
+  long long start;           // now_us() at the request line, 0 once logged
+  long long us[PH_NPHASES];  // time spent in each phase, -1 if it never got there
+  size_t bytes;              // response bytes written to the client
+  int status;                // sent to the client, 0 if nothing was
+  int outcome;               // LOG_*
+  char method[8];
+  char url[LOG_URL];         // truncated if longer
+} access_rec;
+
+/* Head of a block each thread owns, passed on when it exits, see tslot_claim() */
+typedef struct tslot
+{
+  struct tslot *next;        // every slot in the list, newest first
+  int in_use;                // a live thread owns it
+} tslot;
+
+typedef struct
+{
+  tslot *head;               // read with __atomic_load_n, slots are never freed
+  size_t size;               // of the struct each slot heads
+  pthread_mutex_t mutex;
+  pthread_key_t key;
+  int key_made;
+} tslot_list;
+
+#define TSLOT_LIST(type) { NULL, sizeof(type), PTHREAD_MUTEX_INITIALIZER, 0, 0 }
+
+/* Part of a request head: len bytes, off bytes from the start of its buffer */
+typedef struct
+{
+  unsigned off, len;
+} req_span;
+
+#define REQ_MAXHDRS 64                /* client headers passed on to the end server */
+#define REQ_IOV     (REQ_MAXHDRS + 8) /* pieces of the request for the end server, see request_iov() */
+
+/* A client's request head as it is parsed in place (req_feed) */
+typedef struct
+{
+  size_t scanned;      // bytes of whole lines looked at so far
+  size_t start;        // where the request line starts, after any blank lines
+  size_t head_len;     // through the blank line that ends the head, once it is in
+  int got_line;        // the request line has been parsed
+  req_span method, uri;
+  req_span host, path; // parts of the uri; path may be empty
+  int port;
+  req_span host_hdr;   // the client's Host line with its CRLF, len 0 if none
+  req_span hdrs[REQ_MAXHDRS];  // other lines passed on, CRLF included
+  int nhdrs;
+  int http11;
+  int keepalive;       // the client wants the connection kept open
+  int auth;            // sent Authorization: the response isn't shared
+} http_req;
+
+/* Resolved addresses of one host:port (dns.c) */
+typedef struct dns_entry
+{
+  char *key;                // "host:port"
+  struct addrinfo *list;    // from getaddrinfo(), NULL if it failed
+  struct addrinfo **addrv;  // the same addresses, indexable
+  int naddrs;               // 0 for a failed lookup
+  int err;                  // getaddrinfo() error
+  unsigned rotor;           // where the next connect starts in addrv
+  time_t expires;
+  int refcnt;               // the table's reference plus one per user
+  struct dns_entry *next;
+} dns_entry;
+
+/* A connection to an end server, pooled between requests (upstream.c) */
+typedef struct upstream
+{
+  int fd;
+  int reused;          // came out of the pool rather than a fresh connect
+  char key[MAXLINE];   // "host:port"
+  time_t idle_since;
+  struct upstream *next;
+} upstream;
+
+/* Request handling (proxy.c) */
+int request_iov(http_req *q, char *buf, struct iovec *iov, char *host_line, char *extra, size_t extra_len);
+void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+ssize_t writev_at(int fd, struct iovec *iov, int cnt, size_t off);
+int writev_all(int fd, struct iovec *iov, int cnt);
+long long now_ms();
+int splice_body(int fromfd, int tofd, http_resp *r, size_t *moved);
+void cache_response(char *url, cache_tee *t, http_resp *resp, size_t stem_len);
+size_t client_head_end(char *out, int chunked, int keepalive);
+void object_iov(cache_block *b, struct iovec *iov, int keepalive);
+void sock_timeout(int fd, int opt, int secs);
+void sock_timeout_ms(int fd, int opt, long long ms);
+void gateway_error(int fd, char *hostname, int status);
+
+/* Cache (cache.c) */
+void cache_init();
+void cache_key(const char *url, char *key);
+unsigned long url_hash(const char *key);
+cache_block *cache_find(char *url);
+void cache_hold(cache_block *b);
+void cache_put(cache_block *b);
+void cache_uri(char *uri, char *buf, size_t len, size_t head_len, time_t expires);
+int cache_fresh(cache_block *b, long grace);
+void cache_refresh(cache_block *b, time_t expires);
+void cache_stem(cache_block *b, char *out);
+void tee_init(cache_tee *t);
+void tee_append(cache_tee *t, char *data, size_t n);
+void tee_expect(cache_tee *t, size_t total);
+void tee_drop(cache_tee *t);
+void tee_free(cache_tee *t);
+
+size_t cache_object_max();
+unsigned long cache_rejects();
+unsigned long cache_evictions();
+int cache_snapshot();
+
+/* On-disk cache tier (disk.c) */
+void disk_init();
+cache_block *disk_find(const char *key, unsigned long h);
+void disk_release(disk_seg *s);
+void disk_store(cache_block *b);
+void disk_refresh(const char *key, unsigned long h, time_t expires);
+void disk_forget(const char *key, unsigned long h);
+size_t disk_object_max();
+
+/* Collapsed forwarding (flight.c) */
+flight *flight_join(char *url, int *leader);
+flight *flight_solo(char *url);
+void flight_put(flight *f);
+void flight_head(flight *f, char *stem, size_t stem_len, long long clen);
+void flight_body(flight *f, char *data, size_t n);
+void flight_land(flight *f, int ok);
+int flight_wait_head(flight *f, size_t *stem_len, long long *clen);
+ssize_t flight_read(flight *f, size_t off, char *buf, size_t n);
+
+/* Resolver cache (dns.c) */
+dns_entry *dns_lookup(char *hostname, int port);
+dns_entry *dns_cached(char *hostname, int port);
+void dns_lookup_async(char *hostname, int port, void (*done)(void *arg, dns_entry *e), void *arg);
+void dns_put(dns_entry *e);
+unsigned dns_rotate(dns_entry *e);
+struct addrinfo *dns_addr(dns_entry *e, unsigned start, int i);
+void dns_stats(unsigned long *hits, unsigned long *neg_hits, unsigned long *misses);
+
+/* Request parsing and response framing (http.c) */
+void req_init(http_req *q);
+int req_feed(http_req *q, char *buf, size_t n);
+void req_host(http_req *q, const char *buf, char *out);
+void resp_init(http_resp *r);
+ssize_t resp_feed(http_resp *r, char *buf, size_t n, size_t *body);
+int resp_eof(http_resp *r);
+size_t resp_stem(http_resp *r, char *out);
+int hdr_is(const char *p, const char *name);
+int hdr_is_hop(const char *p);
+char *hdr_value(const char *head, const char *name, char *out, size_t n);
+int head_status(const char *head);
+time_t http_date(const char *v);
+time_t resp_refresh(http_resp *r, const char *stem);
+size_t cond_headers(const char *stem, char *out);
+long stale_grace(const char *stem);
+
+/* End server connection pool (upstream.c) */
+void upstream_init();
+upstream *upstream_idle(char *hostname, int port);
+upstream *upstream_new(int fd, char *hostname, int port);
+upstream *upstream_get(char *hostname, int port);
+int upstream_connect(char *hostname, int port);
+void upstream_failed(char *hostname, int port, int status);
+int upstream_down(char *hostname, int port);
+void upstream_put(upstream *u, int reusable);
+
+/* Counters, latency histograms and the metrics page (stats.c) */
+long long now_us();
+tslot *tslot_claim(tslot_list *l);
+void stats_add(int counter, unsigned long n);
+void stats_time(access_rec *r, int phase, long long us);
+void metrics_init();
+
+/* Access log (accesslog.c) */
+void log_init();
+void log_start(access_rec *r);
+void log_url(access_rec *r, const char *method, const char *url);
+void log_request(access_rec *r);
+unsigned long log_drops();
+
+/* Background refresh of stale hits (refresh.c) */
+void refresh_init();
+void refresh_start(char *url, cache_block *b);
+
+/* epoll engine (event.c) */
+void event_run(int listenfd, int nloops);
+
+#endif /* __PROXY_H__ */
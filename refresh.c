@@ -0,0 +1,220 @@
+/*
+ * refresh.c - background revalidation of stale hits
+ *
+ * A hit on an object that went stale less than its grace window ago (see
+ * stale_grace()) is served as it is, and the url is queued here.  A
+ * refresh worker then fetches it from the end server the way a miss
+ * would, conditionally if the stored head has validators: a 304 makes
+ * the block fresh again in place, and a cacheable response replaces it.
+ * Clients never wait for the end server on a hot object that has just
+ * expired.
+ *
+ * A url is queued at most once: hits on it while its refresh is queued or
+ * running just serve the stale copy.  A full queue drops the refresh, and
+ * the next stale hit asks again.
+ */
+#include "proxy.h"
+
+#define REFRESH_BUCKETS 256
+
+/* A url being refreshed; holds a reference on the stale block */
+typedef struct refresh_job {
+  char *url;                  // as the client sent it
+  char *key;                  // normalized, see cache_key()
+  unsigned long hash;
+  cache_block *b;
+  struct refresh_job *next;   // queue
+  struct refresh_job *hnext;  // same bucket of the pending table
+} refresh_job;
+
+static refresh_job *queue_head, *queue_tail;
+static int queued;
+static refresh_job *pending[REFRESH_BUCKETS];  // queued or running, by key
+static pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+
+static void *refresh_worker(void *vargp);
+static void refresh_fetch(refresh_job *j);
+static int refresh_once(refresh_job *j, upstream *u, struct iovec *req, int reqcnt, char *stem);
+
+void refresh_init() {
+  pthread_t tid;
+  int i;
+
+  for (i = 0; i < REFRESH_WORKERS; i++)
+    Pthread_create(&tid, NULL, refresh_worker, NULL);
+}
+
+/*
+ * refresh_start - queue a refresh of url, whose stale block b the caller
+ *     is serving, unless one is already on its way.
+ */
+void refresh_start(char *url, cache_block *b) {
+  char key[MAXLINE];
+  unsigned long h;
+  refresh_job *j;
+
+  cache_key(url, key);
+  h = url_hash(key);
+
+  pthread_mutex_lock(&refresh_mutex);
+  for (j = pending[h % REFRESH_BUCKETS]; j; j = j->hnext) {
+    if (j->hash == h && strcmp(j->key, key) == 0)
+      break;
+  }
+  if (j != NULL || queued >= REFRESH_QUEUE) {
+    pthread_mutex_unlock(&refresh_mutex);
+    return;
+  }
+  j = Malloc(sizeof(refresh_job));
+  j->url = strdup(url);
+  j->key = strdup(key);
+  j->hash = h;
+  j->b = b;
+  cache_hold(b);
+  j->hnext = pending[h % REFRESH_BUCKETS];
+  pending[h % REFRESH_BUCKETS] = j;
+  j->next = NULL;
+  if (queue_tail)
+    queue_tail->next = j;
+  else
+    queue_head = j;
+  queue_tail = j;
+  queued++;
+  pthread_cond_signal(&refresh_cond);
+  pthread_mutex_unlock(&refresh_mutex);
+}
+
+static void *refresh_worker(void *vargp) {
+  refresh_job *j, **pp;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    pthread_mutex_lock(&refresh_mutex);
+    while (queue_head == NULL)
+      pthread_cond_wait(&refresh_cond, &refresh_mutex);
+    j = queue_head;
+    if ((queue_head = j->next) == NULL)
+      queue_tail = NULL;
+    queued--;
+    pthread_mutex_unlock(&refresh_mutex);
+
+    refresh_fetch(j);
+
+    // later stale hits may queue the url again
+    pthread_mutex_lock(&refresh_mutex);
+    for (pp = &pending[j->hash % REFRESH_BUCKETS]; *pp != j; pp = &(*pp)->hnext)
+      ;
+    *pp = j->hnext;
+    pthread_mutex_unlock(&refresh_mutex);
+
+    cache_put(j->b);
+    Free(j->url);
+    Free(j->key);
+    Free(j);
+  }
+  return NULL;
+}
+
+/* Fetch j's url, with the stale block's validators if it has any */
+static void refresh_fetch(refresh_job *j) {
+  char head[MAXLINE + 32], hostname[MAXLINE], host_line[MAXLINE], cond[MAXLINE], stem[MAXBUF + 64];
+  struct iovec req[REQ_IOV];
+  int n, fd, reqcnt;
+  http_req q;
+  upstream *u;
+
+  // the same request a client asking for the url with no headers would make
+  n = snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\n\r\n", j->url);
+  req_init(&q);
+  if ((size_t)n >= sizeof(head) || req_feed(&q, head, n) != 1)
+    return;
+  req_host(&q, head, hostname);
+  cache_stem(j->b, stem);
+  reqcnt = request_iov(&q, head, req, host_line, cond, cond_headers(stem, cond));
+
+  // an end server that just failed to connect stays failed, as for clients
+  if (upstream_down(hostname, q.port))
+    return;
+  errno = 0;
+  if ((u = upstream_get(hostname, q.port)) == NULL) {
+    upstream_failed(hostname, q.port, errno == ETIMEDOUT ? 504 : 502);
+    return;
+  }
+  if (refresh_once(j, u, req, reqcnt, stem) != 1)
+    return;
+  // the pooled one had closed
+  errno = 0;
+  if ((fd = upstream_connect(hostname, q.port)) < 0)
+    upstream_failed(hostname, q.port, errno == ETIMEDOUT ? 504 : 502);
+  else
+    refresh_once(j, upstream_new(fd, hostname, q.port), req, reqcnt, stem);
+}
+
+/*
+ * refresh_once - send request on u and take in the response, like
+ *     forward_request() with nobody to relay it to.  u is parked or closed
+ *     before returning.  Returns 0 when done, -1 on error, and 1 if u came
+ *     from the pool and failed before any response byte arrived.
+ */
+static int refresh_once(refresh_job *j, upstream *u, struct iovec *req, int reqcnt, char *stem) {
+  char buf[MAXBUF];
+  size_t body, stem_len = 0;
+  ssize_t n = 0, used = 0;
+  http_resp resp;
+  cache_tee t;
+
+  sock_timeout(u->fd, SO_SNDTIMEO, config.first_byte_timeout);
+  sock_timeout(u->fd, SO_RCVTIMEO, config.first_byte_timeout);
+  if (writev_all(u->fd, req, reqcnt) < 0) {
+    n = u->reused ? 1 : -1;
+    upstream_put(u, 0);
+    return n;
+  }
+
+  resp_init(&resp);
+  tee_init(&t);
+  while (resp.state != RESP_DONE) {
+    if ((n = read(u->fd, buf, sizeof(buf))) < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      if (n == 0 && resp.head_len == 0 && u->reused) {
+        upstream_put(u, 0);
+        return 1;
+      }
+      if (n < 0 || resp_eof(&resp) < 0)
+        goto fail;
+      break;
+    }
+    if (resp.head_len == 0 && config.read_timeout != config.first_byte_timeout)
+      sock_timeout(u->fd, SO_RCVTIMEO, config.read_timeout);
+    if ((used = resp_feed(&resp, buf, n, &body)) < 0)
+      goto fail;
+
+    if (stem_len == 0 && resp.state != RESP_HEAD) {
+      if (resp.status == 304) {
+        cache_refresh(j->b, resp_refresh(&resp, stem));
+        break;
+      }
+      if (resp.expires < 0 || resp.status >= 500)
+        goto fail;  // nothing to keep; the stale copy stays until the next miss
+      stem_len = resp_stem(&resp, stem);
+      tee_append(&t, stem, stem_len);
+      if (resp.clen > 0)
+        tee_expect(&t, stem_len + resp.clen);
+    }
+    tee_append(&t, buf, body);
+    if (t.toobig)
+      goto fail;
+  }
+  upstream_put(u, resp.state == RESP_DONE && resp.keepalive && used == n);
+  if (t.buf != NULL)
+    cache_response(j->url, &t, &resp, stem_len);
+  tee_free(&t);
+  return 0;
+
+ fail:
+  upstream_put(u, 0);
+  tee_free(&t);
+  return -1;
+}
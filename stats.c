@@ -0,0 +1,201 @@
+/*
+ * stats.c - counters, latency histograms and the metrics page
+ *
+ * Every thread that counts something gets its own stats block the first
+ * time it does, so stats_add() and stats_time() are plain stores to
+ * memory no other thread writes: no lock, no shared cache line.  Blocks
+ * are never freed.  When a thread exits its block is marked free and the
+ * next new thread takes it over, counts and all, so the totals keep
+ * adding up and there are never more blocks than threads alive at once.
+ * tslot_claim() does this handing over, for the access log's rings too.
+ * A scrape sums every block.
+ *
+ * Latency histograms are HDR style (hist.c), each bucket within 1/8 of
+ * the values in it, from 1 us to about 25 days.
+ *
+ * With -M port, a thread serves the sums as a Prometheus text page to
+ * anything that connects to that port.
+ */
+#include "proxy.h"
+#include "hist.h"
+
+#define HIST_SUB_BITS 3  /* 8 buckets per power of two */
+#define HIST_N        HIST_BUCKETS(HIST_SUB_BITS)
+
+typedef struct {
+  tslot slot;                          // first, see tslot_claim()
+  unsigned long count[STAT_NCOUNTERS];
+  unsigned long hist[PH_NPHASES][HIST_N];
+  unsigned long hist_sum[PH_NPHASES];  // us
+} stats_block;
+
+static tslot_list blocks = TSLOT_LIST(stats_block);
+static __thread stats_block *self;
+
+static const char *counter_names[STAT_NCOUNTERS] = {
+  "requests", "cache_hits", "cache_misses", "bytes_from_cache", "bytes_from_origin",
+  "connections_opened", "connections_closed"
+};
+static const char *phase_names[PH_NPHASES] = {
+  "header", "cache_find", "connect", "first_byte", "total"
+};
+
+static void *metrics_thread(void *vargp);
+
+long long now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* The thread is exiting: its slot is free for the next one */
+static void tslot_release(void *vargp) {
+  tslot *s = vargp;
+
+  __atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * tslot_claim - a slot of l for the calling thread: one an exited thread
+ *     left, contents and all, or a zeroed new one.  It is handed back when
+ *     the thread exits.  Callers keep it in a __thread pointer and come
+ *     here only the first time.
+ */
+tslot *tslot_claim(tslot_list *l) {
+  tslot *s;
+
+  pthread_mutex_lock(&l->mutex);
+  if (!l->key_made) {
+    pthread_key_create(&l->key, tslot_release);
+    l->key_made = 1;
+  }
+  for (s = l->head; s; s = s->next) {
+    if (!__atomic_load_n(&s->in_use, __ATOMIC_ACQUIRE))
+      break;
+  }
+  if (s == NULL) {
+    s = Calloc(1, l->size);
+    s->next = l->head;
+    __atomic_store_n(&l->head, s, __ATOMIC_RELEASE);
+  }
+  s->in_use = 1;
+  pthread_mutex_unlock(&l->mutex);
+  pthread_setspecific(l->key, s);
+  return s;
+}
+
+/* This thread's block, taken over or made on first use */
+static stats_block *stats_self() {
+  if (self == NULL)
+    self = (stats_block *)tslot_claim(&blocks);
+  return self;
+}
+
+/* Only the owner writes a counter, so the add needs no atomic instruction */
+static void bump(unsigned long *p, unsigned long n) {
+  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void stats_add(int counter, unsigned long n) {
+  bump(&stats_self()->count[counter], n);
+}
+
+/* Record that phase took us microseconds, in r's access log record too if there is one */
+void stats_time(access_rec *r, int phase, long long us) {
+  stats_block *b = stats_self();
+
+  if (r != NULL)
+    r->us[phase] = us;
+  bump(&b->hist[phase][hist_bucket(us, HIST_SUB_BITS)], 1);
+  bump(&b->hist_sum[phase], us > 0 ? us : 0);
+}
+
+/*******************************
+ * Metrics page (-M)
+ *******************************/
+
+void metrics_init() {
+  pthread_t tid;
+
+  if (config.metrics_port != NULL)
+    Pthread_create(&tid, NULL, metrics_thread, NULL);
+}
+
+/* Sum every block and write the page into out (n bytes); returns its length */
+static size_t metrics_page(char *out, size_t n) {
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  static unsigned long hist[PH_NPHASES][HIST_N];  // only metrics_thread() uses it
+  unsigned long count[STAT_NCOUNTERS] = { 0 }, sum[PH_NPHASES] = { 0 }, total, dh, dn, dm;
+  int threads = 0, i, j, q;
+  stats_block *b;
+  size_t len = 0;
+
+  memset(hist, 0, sizeof(hist));
+  for (b = (stats_block *)__atomic_load_n(&blocks.head, __ATOMIC_ACQUIRE); b; b = (stats_block *)b->slot.next) {
+    threads += __atomic_load_n(&b->slot.in_use, __ATOMIC_RELAXED);
+    for (i = 0; i < STAT_NCOUNTERS; i++)
+      count[i] += __atomic_load_n(&b->count[i], __ATOMIC_RELAXED);
+    for (i = 0; i < PH_NPHASES; i++) {
+      sum[i] += __atomic_load_n(&b->hist_sum[i], __ATOMIC_RELAXED);
+      for (j = 0; j < HIST_N; j++)
+        hist[i][j] += __atomic_load_n(&b->hist[i][j], __ATOMIC_RELAXED);
+    }
+  }
+
+#define EMIT(...) len += snprintf(out + len, len < n ? n - len : 0, __VA_ARGS__)
+  for (i = 0; i < STAT_NCOUNTERS; i++)
+    EMIT("# TYPE proxy_%s_total counter\nproxy_%s_total %lu\n", counter_names[i], counter_names[i], count[i]);
+  EMIT("# TYPE proxy_connections gauge\nproxy_connections %lu\n",
+       count[STAT_CONNS_OPENED] - count[STAT_CONNS_CLOSED]);
+  EMIT("# TYPE proxy_threads gauge\nproxy_threads %d\n", threads);
+  EMIT("# TYPE proxy_cache_evictions_total counter\nproxy_cache_evictions_total %lu\n", cache_evictions());
+  EMIT("# TYPE proxy_cache_rejects_total counter\nproxy_cache_rejects_total %lu\n", cache_rejects());
+  EMIT("# TYPE proxy_log_dropped_total counter\nproxy_log_dropped_total %lu\n", log_drops());
+  dns_stats(&dh, &dn, &dm);
+  EMIT("# TYPE proxy_dns_lookups_total counter\n"
+       "proxy_dns_lookups_total{result=\"hit\"} %lu\n"
+       "proxy_dns_lookups_total{result=\"negative_hit\"} %lu\n"
+       "proxy_dns_lookups_total{result=\"miss\"} %lu\n", dh, dn, dm);
+
+  EMIT("# TYPE proxy_phase_seconds summary\n");
+  for (i = 0; i < PH_NPHASES; i++) {
+    for (total = 0, j = 0; j < HIST_N; j++)
+      total += hist[i][j];
+    for (q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); q++)
+      EMIT("proxy_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.6f\n", phase_names[i], quantiles[q],
+           total ? hist_quantile(hist[i], total, quantiles[q], HIST_SUB_BITS) / 1e6 : 0.0);
+    EMIT("proxy_phase_seconds_sum{phase=\"%s\"} %.6f\n", phase_names[i], sum[i] / 1e6);
+    EMIT("proxy_phase_seconds_count{phase=\"%s\"} %lu\n", phase_names[i], total);
+  }
+#undef EMIT
+  return len < n ? len : n - 1;
+}
+
+/* Answer every connection to the admin port with the metrics page */
+static void *metrics_thread(void *vargp) {
+  char buf[MAXLINE], *page = Malloc(4 * MAXBUF);
+  int listenfd, connfd;
+  size_t len;
+  rio_t rio;
+
+  Pthread_detach(pthread_self());
+  listenfd = Open_listenfd(config.metrics_port);
+  while (1) {
+    if ((connfd = accept(listenfd, NULL, NULL)) < 0)
+      continue;
+    // whatever was asked for; the request is read so closing doesn't reset the reply
+    sock_timeout(connfd, SO_RCVTIMEO, 1);
+    sock_timeout(connfd, SO_SNDTIMEO, 1);
+    Rio_readinitb(&rio, connfd);
+    while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n") && strcmp(buf, "\n"))
+      ;
+    len = metrics_page(page, 4 * MAXBUF);
+    snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n\r\n", len);
+    if (rio_writen(connfd, buf, strlen(buf)) >= 0)
+      rio_writen(connfd, page, len);
+    close(connfd);
+  }
+  return NULL;
+}
@@ -17,6 +17,8 @@ void serve_dynamic(int fd, char *filename, char *cgiargs, char *method, char *ve
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
                  char *longmsg);
 
+int verbose;  /* -v: print every connection and header block (slow under load) */
+
 int main(int argc, char **argv) {
   int listenfd, connfd;
   char hostname[MAXLINE], port[MAXLINE];
@@ -24,8 +26,11 @@ int main(int argc, char **argv) {
   struct sockaddr_storage clientaddr;
 
   /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  if (argc == 3 && strcmp(argv[1], "-v") == 0) {
+    verbose = 1;
+    argv++;
+  } else if (argc != 2) {
+    fprintf(stderr, "usage: %s [-v] <port>\n", argv[0]);
     exit(1);
   }
 
@@ -33,8 +38,10 @@ int main(int argc, char **argv) {
   while (1) {
     clientlen = sizeof(clientaddr);
     connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);  // line:netp:tiny:accept
-    Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE,0);
-    printf("Accepted connection from (%s, %s)\n", hostname, port);
+    if (verbose) {
+      Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE,0);
+      printf("Accepted connection from (%s, %s)\n", hostname, port);
+    }
     doit(connfd);   // line:netp:tiny:doit
     Close(connfd);  // line:netp:tiny:close
   }
@@ -50,8 +57,10 @@ void doit(int fd)
   /* Read request line and headers*/
   Rio_readinitb(&rio, fd);
   Rio_readlineb(&rio, buf, MAXLINE);
-  printf("REquest headers: \n");
-  printf("%s", buf);
+  if (verbose) {
+    printf("REquest headers: \n");
+    printf("%s", buf);
+  }
   sscanf(buf, "%s %s %s", method, uri, version);
   // if (strcasecmp(method, "GET")){
   //   clienterror(fd, method, "501", "Not implemented", "Tiny does not implement this method");
@@ -116,7 +125,8 @@ void read_requesthdrs(rio_t *rp)
   Rio_readlineb(rp, buf, MAXLINE);
   while (strcmp(buf, "\r\n")) {
     Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
+    if (verbose)
+      printf("%s", buf);
   }
   return;
 }
@@ -160,8 +170,10 @@ void serve_static(int fd, char *filename, int filesize, char *method, char *vers
   sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
   sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
   Rio_writen(fd,buf, strlen(buf));
-  printf("Response headers:\n");
-  printf("%s", buf);
+  if (verbose) {
+    printf("Response headers:\n");
+    printf("%s", buf);
+  }
 
    /* Send response body to client */
   if (strcasecmp(method,"HEAD") == 0) {
@@ -0,0 +1,358 @@
+/*
+ * upstream.c - pool of idle persistent connections to end servers
+ *
+ * Connections are kept per (host, port).  upstream_get() hands out the
+ * most recently parked idle connection that is still open, or opens a new
+ * one; upstream_put() parks a connection whose response ended cleanly, up
+ * to config.upstream_idle_max idle connections per host.  That caps only
+ * what is parked: a request that finds no idle connection always opens a
+ * new one, so the number open to a host at once is not limited.  A reaper
+ * thread closes connections idle for longer than config.upstream_idle
+ * seconds.
+ *
+ * New connections are raced across the end server's addresses, see
+ * upstream_connect().
+ *
+ * A host that could not be connected to is remembered as down for
+ * config.neg_connect_ttl seconds: upstream_down() fails its requests at
+ * once instead of each one waiting out another connect.
+ *
+ * A host gets an entry only once a connection to it is parked or a
+ * connect to it fails, and the reaper frees entries with neither.  Each
+ * bucket has its own lock, and upstream_down() takes none while no host
+ * is down.
+ */
+#include "proxy.h"
+#include <poll.h>
+
+#define POOL_BUCKETS 256
+
+/* Idle connections to one host:port, most recently used first */
+typedef struct pool_host {
+  char *key;
+  upstream *idle;
+  int nidle;
+  time_t down_until;   // connects failed: fail requests until then
+  int down_status;     // with this status, 502 or 504
+  struct pool_host *next;
+} pool_host;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pool_host *hosts;
+} pool_bucket;
+
+static pool_bucket pool[POOL_BUCKETS];
+static int pool_ndown;   // entries with down_until set, atomic
+
+static void *pool_reaper(void *vargp);
+
+static unsigned key_hash(const char *key) {
+  unsigned h = 5381;
+  while (*key)
+    h = h * 33 + (unsigned char)*key++;
+  return h % POOL_BUCKETS;
+}
+
+/* The entry for key in bucket b, added if create, else NULL. b->mutex held */
+static pool_host *pool_find(pool_bucket *b, const char *key, int create) {
+  pool_host *ph;
+
+  for (ph = b->hosts; ph; ph = ph->next) {
+    if (!strcmp(ph->key, key))
+      return ph;
+  }
+  if (!create)
+    return NULL;
+  ph = Calloc(1, sizeof(pool_host));
+  ph->key = strdup(key);
+  ph->next = b->hosts;
+  b->hosts = ph;
+  return ph;
+}
+
+/* Has the end server closed (or written to) this idle connection? */
+static int upstream_stale(upstream *u) {
+  char c;
+  ssize_t n = recv(u->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  return !(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+void upstream_init() {
+  pthread_t tid;
+  int i;
+
+  for (i = 0; i < POOL_BUCKETS; i++)
+    pthread_mutex_init(&pool[i].mutex, NULL);
+  if (config.upstream_idle_max > 0 || config.neg_connect_ttl > 0)
+    Pthread_create(&tid, NULL, pool_reaper, NULL);
+}
+
+/*
+ * upstream_idle - take a live idle connection to hostname:port out of the
+ *     pool, or return NULL if there is none.
+ */
+upstream *upstream_idle(char *hostname, int port) {
+  char key[MAXLINE];
+  pool_bucket *b;
+  pool_host *ph;
+  upstream *u = NULL;
+
+  if (config.upstream_idle_max <= 0)
+    return NULL;
+  snprintf(key, sizeof(key), "%s:%d", hostname, port);
+  b = &pool[key_hash(key)];
+  while (1) {
+    // pop under the lock, probe outside it
+    pthread_mutex_lock(&b->mutex);
+    if ((ph = pool_find(b, key, 0)) != NULL && (u = ph->idle) != NULL) {
+      ph->idle = u->next;
+      ph->nidle--;
+    }
+    pthread_mutex_unlock(&b->mutex);
+    if (u == NULL || !upstream_stale(u))
+      break;
+    close(u->fd);
+    Free(u);
+    u = NULL;
+  }
+
+  if (u) {
+    u->reused = 1;
+    u->next = NULL;
+  }
+  return u;
+}
+
+/* Wrap a freshly connected fd for the pool */
+upstream *upstream_new(int fd, char *hostname, int port) {
+  upstream *u = Malloc(sizeof(upstream));
+
+  u->fd = fd;
+  u->reused = 0;
+  snprintf(u->key, sizeof(u->key), "%s:%d", hostname, port);
+  u->next = NULL;
+  return u;
+}
+
+/*
+ * upstream_get - a blocking connection to hostname:port, pooled if one is
+ *     idle, else new.  Returns NULL if the connection cannot be opened.
+ */
+upstream *upstream_get(char *hostname, int port) {
+  upstream *u;
+  int fd, flags;
+
+  if ((u = upstream_idle(hostname, port)) != NULL) {
+    // the epoll engine parks its connections non-blocking
+    if ((flags = fcntl(u->fd, F_GETFL, 0)) >= 0 && (flags & O_NONBLOCK))
+      fcntl(u->fd, F_SETFL, flags & ~O_NONBLOCK);
+    return u;
+  }
+  if ((fd = upstream_connect(hostname, port)) < 0)
+    return NULL;
+  return upstream_new(fd, hostname, port);
+}
+
+/*
+ * upstream_connect - connect to hostname:port, happy-eyeballs style: the
+ *     next address is tried CONNECT_STAGGER ms after the last one, or as
+ *     soon as every attempt so far has failed, and the first to connect
+ *     wins.  Gives up after config.connect_timeout ms, so a blackholed
+ *     address costs a stagger rather than the kernel's SYN retries.
+ *     Returns a blocking fd, or -1 with errno ETIMEDOUT if that is why.
+ */
+int upstream_connect(char *hostname, int port) {
+  struct pollfd pfd[CONNECT_MAX_TRY];
+  dns_entry *e = dns_lookup(hostname, port);
+  unsigned start = dns_rotate(e);
+  long long now, deadline, next_try;
+  int i, s, fd = -1, n = 0, live = 0, next = 0, wait, err, flags, timedout = 0;
+  socklen_t len;
+  struct addrinfo *p;
+
+  now = next_try = now_ms();
+  deadline = now + config.connect_timeout;
+  while (fd < 0) {
+    if (next < e->naddrs && n < CONNECT_MAX_TRY && (live == 0 || now >= next_try)) {
+      p = dns_addr(e, start, next++);
+      if ((s = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol)) < 0)
+        continue;
+      if (connect(s, p->ai_addr, p->ai_addrlen) == 0) {
+        fd = s;
+        break;
+      }
+      if (errno != EINPROGRESS) {
+        close(s);
+        continue;
+      }
+      pfd[n].fd = s;
+      pfd[n].events = POLLOUT;
+      n++;
+      live++;
+      next_try = now + CONNECT_STAGGER;
+      continue;
+    }
+    if (live == 0)
+      break;
+    if (now >= deadline) {
+      timedout = 1;
+      break;
+    }
+
+    wait = deadline - now;
+    if (next < e->naddrs && n < CONNECT_MAX_TRY && next_try - now < wait)
+      wait = next_try - now;
+    if (poll(pfd, n, wait) < 0 && errno != EINTR)
+      break;
+    for (i = 0; i < n && fd < 0; i++) {
+      if (pfd[i].fd < 0 || pfd[i].revents == 0)
+        continue;
+      err = 0;
+      len = sizeof(err);
+      getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err == 0) {
+        fd = pfd[i].fd;
+      } else {
+        close(pfd[i].fd);
+        live--;
+      }
+      pfd[i].fd = -1;  // poll() skips it from now on
+    }
+    now = now_ms();
+  }
+
+  for (i = 0; i < n; i++) {
+    if (pfd[i].fd >= 0)
+      close(pfd[i].fd);
+  }
+  dns_put(e);
+  if (fd >= 0 && (flags = fcntl(fd, F_GETFL, 0)) >= 0)
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+  if (timedout)
+    errno = ETIMEDOUT;
+  return fd;
+}
+
+/*
+ * upstream_put - done with u.  If its last response ended cleanly and the
+ *     end server will keep it open (reusable), park it for the next request
+ *     to the same host; otherwise close it.
+ */
+void upstream_put(upstream *u, int reusable) {
+  pool_bucket *b;
+  pool_host *ph;
+
+  if (reusable && config.upstream_idle_max > 0) {
+    b = &pool[key_hash(u->key)];
+    pthread_mutex_lock(&b->mutex);
+    ph = pool_find(b, u->key, 1);
+    if (ph->nidle < config.upstream_idle_max) {
+      u->idle_since = time(NULL);
+      u->next = ph->idle;
+      ph->idle = u;
+      ph->nidle++;
+      u = NULL;
+    }
+    pthread_mutex_unlock(&b->mutex);
+    if (u == NULL)
+      return;
+  }
+  close(u->fd);
+  Free(u);
+}
+
+/*
+ * upstream_failed - a connect to hostname:port just failed.  For the next
+ *     config.neg_connect_ttl seconds upstream_down() fails its requests
+ *     with status: 502, or 504 if the connect timed out.
+ */
+void upstream_failed(char *hostname, int port, int status) {
+  char key[MAXLINE];
+  pool_bucket *b;
+  pool_host *ph;
+
+  if (config.neg_connect_ttl <= 0)
+    return;
+  snprintf(key, sizeof(key), "%s:%d", hostname, port);
+  b = &pool[key_hash(key)];
+  pthread_mutex_lock(&b->mutex);
+  ph = pool_find(b, key, 1);
+  if (ph->down_until == 0)
+    __atomic_add_fetch(&pool_ndown, 1, __ATOMIC_RELAXED);
+  ph->down_until = time(NULL) + config.neg_connect_ttl;
+  ph->down_status = status;
+  pthread_mutex_unlock(&b->mutex);
+}
+
+/* The status to fail a request to hostname:port with right away, or 0 to go ahead */
+int upstream_down(char *hostname, int port) {
+  char key[MAXLINE];
+  pool_bucket *b;
+  pool_host *ph;
+  int status = 0;
+
+  if (config.neg_connect_ttl <= 0 || __atomic_load_n(&pool_ndown, __ATOMIC_RELAXED) == 0)
+    return 0;
+  snprintf(key, sizeof(key), "%s:%d", hostname, port);
+  b = &pool[key_hash(key)];
+  pthread_mutex_lock(&b->mutex);
+  if ((ph = pool_find(b, key, 0)) != NULL && ph->down_until > time(NULL))
+    status = ph->down_status;
+  pthread_mutex_unlock(&b->mutex);
+  return status;
+}
+
+/*
+ * Close connections that have been idle longer than config.upstream_idle,
+ * and free entries with no idle connections that are no longer down.
+ */
+static void *pool_reaper(void *vargp) {
+  pool_host **hp, *ph;
+  upstream **pp, *u, *dead;
+  time_t now;
+  int i;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    sleep(config.upstream_idle > 1 ? config.upstream_idle / 2 : 1);
+    now = time(NULL);
+    dead = NULL;
+
+    for (i = 0; i < POOL_BUCKETS; i++) {
+      pthread_mutex_lock(&pool[i].mutex);
+      for (hp = &pool[i].hosts; (ph = *hp) != NULL; ) {
+        for (pp = &ph->idle; (u = *pp) != NULL; ) {
+          if (now - u->idle_since >= config.upstream_idle) {
+            *pp = u->next;
+            ph->nidle--;
+            u->next = dead;
+            dead = u;
+          } else {
+            pp = &u->next;
+          }
+        }
+        if (ph->down_until != 0 && ph->down_until <= now) {
+          ph->down_until = 0;
+          __atomic_sub_fetch(&pool_ndown, 1, __ATOMIC_RELAXED);
+        }
+        if (ph->nidle == 0 && ph->down_until == 0) {
+          *hp = ph->next;
+          free(ph->key);
+          Free(ph);
+        } else {
+          hp = &ph->next;
+        }
+      }
+      pthread_mutex_unlock(&pool[i].mutex);
+    }
+
+    while ((u = dead) != NULL) {
+      dead = u->next;
+      close(u->fd);
+      Free(u);
+    }
+  }
+  return NULL;
+}